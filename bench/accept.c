@@ -0,0 +1,200 @@
+/* Accept throughput benchmark for serve
+
+   Runs src/serve with 1, 2, 4, ... workers up to the number of CPUs, first
+   sharing one listening socket ("-w") and then with a SO_REUSEPORT socket
+   each ("-R -w"), and counts how many connections a second it gets through
+   while clients connect, ask for a small file and hang up as fast as they
+   can. With -R the count should grow with the number of workers, since they
+   don't all wait on one accept queue.
+
+   Usage: bench/accept [SECONDS [MAX_WORKERS]]
+
+   By James Stanley
+
+   Public domain */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 8098
+#define CLIENTS_PER_WORKER 4
+#define REQUEST "GET /index.html HTTP/1.0\r\n\r\n"
+
+static volatile int running;
+
+/* Returns a socket connected to the server, or -1 if it isn't there */
+static int connect_server(void) {
+  struct sockaddr_in addr;
+  int fd;
+
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+
+  memset(&addr, '\0', sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Makes connections until running is cleared, counting the ones that were
+   answered in the long that arg points to */
+static void *client(void *arg) {
+  char buf[4096];
+  long *done = arg;
+  int fd;
+
+  while(running) {
+    if((fd = connect_server()) == -1) continue;
+    if(write(fd, REQUEST, sizeof(REQUEST) - 1) == sizeof(REQUEST) - 1) {
+      while(read(fd, buf, sizeof(buf)) > 0);
+      (*done)++;
+    }
+    close(fd);
+  }
+
+  return NULL;
+}
+
+/* Starts serve with the given number of workers, with its own listening
+   socket each if reuse is set, in its own process group.
+   Returns its pid */
+static pid_t start_server(const char *serve, const char *mimetypes,
+                          int workers, int reuse) {
+  char num[16], port[16];
+  pid_t pid;
+  int fd, i;
+
+  sprintf(num, "%d", workers);
+  sprintf(port, "%d", PORT);
+
+  if((pid = fork()) == -1) {
+    perror("fork");
+    exit(1);
+  }
+
+  if(pid == 0) {
+    setpgid(0, 0);
+    if((fd = open("/dev/null", O_WRONLY)) != -1) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execl(serve, serve, "-l", "127.0.0.1", "-p", port, "-m", mimetypes,
+          "-w", num, reuse ? "-R" : (char*)NULL, (char*)NULL);
+    _exit(1);
+  }
+
+  /* wait for it to be listening */
+  for(i = 0; i < 500; i++) {
+    if((fd = connect_server()) != -1) {
+      close(fd);
+      break;
+    }
+    usleep(10000);
+  }
+
+  return pid;
+}
+
+/* Stops the server started by start_server() and all of its workers */
+static void stop_server(pid_t pid) {
+  kill(-pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  usleep(100000);
+}
+
+/* Returns how many connections a second serve gets through with the given
+   number of workers, over the given number of seconds */
+static double run(const char *serve, const char *mimetypes, int workers,
+                  int reuse, int seconds) {
+  int clients = workers * CLIENTS_PER_WORKER;
+  pthread_t *thread = malloc(clients * sizeof(pthread_t));
+  long *done = calloc(clients, sizeof(long));
+  struct timespec start, end;
+  double secs;
+  long total = 0;
+  pid_t pid;
+  int i;
+
+  pid = start_server(serve, mimetypes, workers, reuse);
+
+  running = 1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(i = 0; i < clients; i++)
+    pthread_create(&thread[i], NULL, client, &done[i]);
+  sleep(seconds);
+  running = 0;
+  for(i = 0; i < clients; i++) {
+    pthread_join(thread[i], NULL);
+    total += done[i];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  stop_server(pid);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  free(thread);
+  free(done);
+
+  return total / secs;
+}
+
+int main(int argc, char **argv) {
+  char serve[PATH_MAX], mimetypes[PATH_MAX];
+  char dir[] = "/tmp/serve-bench-XXXXXX";
+  int seconds = argc > 1 ? atoi(argv[1]) : 3;
+  int max = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  double shared, reuse;
+  FILE *f;
+  int n;
+
+  if(!realpath("src/serve", serve) ||
+     !realpath("misc/serve_mimetypes", mimetypes)) {
+    fprintf(stderr, "Run bench/accept from the top of the source tree, after "
+            "building src/serve.\n");
+    return 1;
+  }
+
+  /* serve a small file from somewhere of our own */
+  if(!mkdtemp(dir) || chdir(dir) == -1 ||
+     !(f = fopen("index.html", "w"))) {
+    perror(dir);
+    return 1;
+  }
+  fputs("<html><body>Hello</body></html>\n", f);
+  fclose(f);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%-8s %14s %14s\n", "workers", "shared conn/s", "-R conn/s");
+  for(n = 1;; n *= 2) {
+    if(n > max) n = max;
+    shared = run(serve, mimetypes, n, 0, seconds);
+    reuse = run(serve, mimetypes, n, 1, seconds);
+    printf("%-8d %14.0f %14.0f\n", n, shared, reuse);
+    fflush(stdout);
+    if(n == max) break;
+  }
+
+  unlink("index.html");
+  chdir("/");
+  rmdir(dir);
+
+  return 0;
+}
@@ -0,0 +1,73 @@
+/* HTTP date parsing benchmark for serve
+
+   Times get_date() on each of the three formats that HTTP allows, against
+   the old way of trying strptime() with each format in turn and then calling
+   mktime(), which also has to look at the local time zone.
+
+   Usage: bench/date [ITERATIONS]
+
+   By James Stanley
+
+   Public domain */
+
+#include "../src/serve.h"
+
+static const char *dates[] = {
+  "Sun, 06 Nov 1994 08:49:37 GMT",
+  "Sunday, 06-Nov-94 08:49:37 GMT",
+  "Sun Nov  6 08:49:37 1994"
+};
+
+static const char *formats[] = {
+  "IMF-fixdate", "RFC 850", "asctime"
+};
+
+#define DATES (sizeof(dates) / sizeof(dates[0]))
+
+/* The old get_date() */
+static time_t old_get_date(const char *str) {
+  struct tm tm_time;
+
+  memset(&tm_time, '\0', sizeof(struct tm));
+
+  if(strptime(str, "%a, %d %b %Y %T %Z", &tm_time) == NULL)
+    if(strptime(str, "%A, %d-%b-%y %T %Z", &tm_time) == NULL)
+      if(strptime(str, "%a %b %T %Y", &tm_time) == NULL)
+        return 0;
+
+  return mktime(&tm_time);
+}
+
+/* Returns the time now, in nanoseconds */
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns how long parse takes to read str, in nanoseconds */
+static double time_parse(time_t (*parse)(const char *), const char *str,
+                         long iterations) {
+  volatile time_t t;
+  double start = now();
+  long n;
+
+  for(n = 0; n < iterations; n++) t = parse(str);
+  (void)t;
+
+  return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  int i;
+
+  printf("%-12s %10s %10s\n", "format", "old ns", "new ns");
+  for(i = 0; i < DATES; i++)
+    printf("%-12s %10.1f %10.1f\n", formats[i],
+           time_parse(old_get_date, dates[i], iterations),
+           time_parse(get_date, dates[i], iterations));
+
+  return 0;
+}
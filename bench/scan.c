@@ -0,0 +1,198 @@
+/* Request scanning benchmark for serve
+
+   Times splitting up a typical browser request line and its headers the way
+   serve does it now, with split_request() and parse_headers() on top of
+   scan(), both byte by byte and with whatever SIMD the CPU has, against the
+   way it used to: method_type(), requ_file() and http_version() each walking
+   the request line again, and next_header() finding each colon and line end
+   with strchr() and copying out every name and value. The old functions are
+   fed from memory rather than a byte at a time from the socket, so they look
+   better here than they really were.
+
+   Usage: bench/scan [ITERATIONS]
+
+   By James Stanley
+
+   Public domain */
+
+#include "../src/serve.h"
+
+#include <time.h>
+
+#define OLD_HEADERS 64
+
+static const char request_line[] =
+  "GET /images/banner.png?v=20240101 HTTP/1.1";
+
+static const char request_headers[] =
+  "Host: www.example.com\r\n"
+  "Connection: keep-alive\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+  "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\n"
+  "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Dest: image\r\n"
+  "Referer: https://www.example.com/index.html\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+  "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+  "\r\n";
+
+/* a name and value that old_headers() copied out */
+typedef struct old_header_s {
+  char *name;
+  char *value;
+} old_header;
+
+/* The old method_type(), which found the end of the method itself */
+static int old_method_type(const char *buf) {
+  const char *ptr, *end;
+  int i;
+
+  for(ptr = buf; *ptr && iswhite(*ptr); ptr++);
+  for(end = ptr; *end && !iswhite(*end); end++);
+
+  for(i = 0; i < METHODS; i++)
+    if(strncasecmp(method[i], ptr, end - ptr) == 0) return i;
+
+  return -1;
+}
+
+/* The old requ_file(), which walked past the method again */
+static char *old_requ_file(const char *buf) {
+  const char *ptr, *end;
+
+  for(ptr = buf; *ptr && iswhite(*ptr); ptr++);
+  for(; *ptr && !iswhite(*ptr); ptr++);
+  for(; *ptr && iswhite(*ptr); ptr++);
+  for(end = ptr; *end && !iswhite(*end); end++);
+
+  return strdup2(ptr, end - ptr);
+}
+
+/* The old http_version(), which walked past the method and file again */
+static char *old_http_version(const char *buf) {
+  const char *ptr;
+  char *p, *q;
+
+  for(ptr = buf; *ptr && iswhite(*ptr); ptr++);
+  for(; *ptr && !iswhite(*ptr); ptr++);
+  for(; *ptr && iswhite(*ptr); ptr++);
+  for(; *ptr && !iswhite(*ptr); ptr++);
+  for(; *ptr && iswhite(*ptr); ptr++);
+
+  if(!*ptr) return NULL;
+
+  p = strdup(ptr);
+  for(q = p; *q && !iswhite(*q); q++);
+  *q = '\0';
+
+  return p;
+}
+
+/* Splits up the header lines in buf the way next_header() did, a line at a
+   time with strchr(), copying each name and value in to list.
+   Returns the number of headers */
+static int old_headers(const char *buf, old_header *list) {
+  const char *line, *nl, *colon, *value;
+  int num = 0;
+
+  for(line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+    if(nl == line || (nl == line + 1 && *line == '\r')) break;
+    if(!(colon = strchr(line, ':')) || colon > nl || num == OLD_HEADERS)
+      continue;
+
+    list[num].name = strdup2(line, colon - line);
+    for(value = colon + 1; iswhite(*value); value++);
+    list[num].value = strdup2(value, nl - value - (nl[-1] == '\r'));
+    num++;
+  }
+
+  return num;
+}
+
+/* Returns the time now, in nanoseconds */
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns how long the old functions take over one request, in
+   nanoseconds */
+static double time_old(long iterations) {
+  old_header list[OLD_HEADERS];
+  char *file, *version;
+  double start = now();
+  long n;
+  int i, num;
+
+  for(n = 0; n < iterations; n++) {
+    if(old_method_type(request_line) != GET) abort();
+    file = old_requ_file(request_line);
+    version = old_http_version(request_line);
+    num = old_headers(request_headers, list);
+
+    free(file);
+    free(version);
+    for(i = 0; i < num; i++) {
+      free(list[i].name);
+      free(list[i].value);
+    }
+  }
+
+  return (now() - start) / iterations;
+}
+
+/* Returns how long split_request() and parse_headers() take over one
+   request, in nanoseconds, with the scanner that's in use */
+static double time_new(long iterations) {
+  char line[sizeof(request_line)];
+  char block[sizeof(request_headers)];
+  const char *tok[3];
+  size_t tok_len[3];
+  size_t len, length;
+  headers h;
+  double start = now();
+  long n;
+
+  memset(&h, '\0', sizeof(h));
+
+  for(n = 0; n < iterations; n++) {
+    /* they both work on a copy of their own, like a request does */
+    memcpy(line, request_line, sizeof(line));
+    if(split_request(line, tok, tok_len) == -1 ||
+       method_type(tok[0], tok_len[0]) != GET)
+      abort();
+
+    len = headers_length(request_headers, sizeof(request_headers) - 1);
+    memcpy(block, request_headers, len);
+    if(parse_headers(&h, block, len, &length) == -1) abort();
+    free_headers(&h);
+  }
+
+  return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  double old_ns, bytes_ns, simd_ns;
+
+  old_ns = time_old(iterations);
+  bytes_ns = time_new(iterations);/* scan() starts off byte by byte */
+  init_scan();
+  simd_ns = time_new(iterations);
+
+  printf("%zu byte request line and headers, %ld times:\n",
+         sizeof(request_line) + sizeof(request_headers) - 1, iterations);
+  printf("  old functions           %8.1f ns\n", old_ns);
+  printf("  scan() byte by byte     %8.1f ns\n", bytes_ns);
+  printf("  scan() %-16s %8.1f ns\n", scanner_name, simd_ns);
+
+  return 0;
+}
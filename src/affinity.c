@@ -0,0 +1,228 @@
+/* CPU and NUMA placement of workers for serve
+
+   Workers can be left wherever the scheduler puts them ("none"), pinned to a
+   CPU each ("core"), spread over the NUMA nodes with their memory on their
+   own node ("numa"), or pinned to a CPU each with their listening socket
+   asking the kernel for the connections that arrive on that CPU
+   ("incoming"). Each worker counts how many of its connections arrived on the
+   CPU it was running on, and logs that on SIGUSR1 so that the policies can be
+   compared.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#define NODE_DIR "/sys/devices/system/node"
+
+stats worker_stats;
+volatile sig_atomic_t stats_wanted;
+
+static int worker_id = -1;/* -1 unless we're a worker */
+
+char *affinity_name[] = { "none", "core", "numa", "incoming" };
+
+/* Returns the affinity policy called name, or -1 if there isn't one */
+int affinity_policy(const char *name) {
+  int i;
+
+  for(i = 0; i < AFFINITIES; i++)
+    if(strcmp(name, affinity_name[i]) == 0) return i;
+
+  return -1;
+}
+
+/* Restricts this process to running on the given CPU; returns 0 on success and
+   -1 on error */
+int pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  return sched_setaffinity(0, sizeof(set), &set);
+#else
+  return -1;
+#endif
+}
+
+#ifdef __linux__
+static int compare_ints(const void *a, const void *b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+/* Puts the CPUs that belong to NUMA node number node in set.
+   Returns the number of CPUs, or -1 if there's no such node */
+static int node_cpus(int node, cpu_set_t *set) {
+  char path[sizeof(NODE_DIR) + decimal_length(int) + 16];
+  FILE *fp;
+  int first, last, n = 0;
+  char c;
+
+  sprintf(path, NODE_DIR "/node%d/cpulist", node);
+  if(!(fp = fopen(path, "r"))) return -1;
+
+  CPU_ZERO(set);
+
+  /* the list looks like "0-3,8-11" */
+  while(fscanf(fp, "%d", &first) == 1) {
+    last = first;
+    if((c = fgetc(fp)) == '-') {
+      if(fscanf(fp, "%d", &last) != 1) break;
+      c = fgetc(fp);
+    }
+
+    for(; first <= last && first < CPU_SETSIZE; first++, n++)
+      CPU_SET(first, set);
+
+    if(c != ',') break;
+  }
+
+  fclose(fp);
+
+  return n;
+}
+
+/* Puts the number of the nth NUMA node that has any CPUs in node, and its CPUs
+   in set, counting round again if there are fewer than n+1 of them.
+   Returns 0 on success, or -1 if the nodes can't be found */
+static int nth_node(int n, int *node, cpu_set_t *set) {
+  struct dirent *ent;
+  DIR *dir;
+  int *nodes = NULL;
+  int num = 0, i;
+
+  if(!(dir = opendir(NODE_DIR))) return -1;
+
+  while((ent = readdir(dir))) {
+    if(strncmp(ent->d_name, "node", 4) != 0 || !isdigit(ent->d_name[4]))
+      continue;
+
+    /* nodes with only memory on them are no use to a worker */
+    i = atoi(ent->d_name + 4);
+    if(node_cpus(i, set) <= 0) continue;
+
+    nodes = realloc(nodes, (num + 1) * sizeof(int));
+    nodes[num++] = i;
+  }
+
+  closedir(dir);
+
+  if(!num) return -1;
+
+  /* readdir() doesn't sort them */
+  qsort(nodes, num, sizeof(int), compare_ints);
+
+  *node = nodes[n % num];
+  free(nodes);
+
+  node_cpus(*node, set);
+
+  return 0;
+}
+
+/* Restricts this process to the CPUs of the nth NUMA node, and asks for its
+   memory to come from that node.
+   Returns the node number on success, or -1 on error */
+static int bind_to_node(int n) {
+  unsigned long mask[16];
+  cpu_set_t set;
+  int node;
+
+  if(nth_node(n, &node, &set) == -1) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if(sched_setaffinity(0, sizeof(set), &set) == -1) return -1;
+
+  /* only preferred, so that a full node means slower memory rather than the
+     OOM killer */
+  if(node < (int)(sizeof(mask) * CHAR_BIT)) {
+    memset(mask, '\0', sizeof(mask));
+    mask[node / (sizeof(long) * CHAR_BIT)] |=
+      1UL << (node % (sizeof(long) * CHAR_BIT));
+    if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+               sizeof(mask) * CHAR_BIT) == -1)
+      return -1;
+  }
+
+  return node;
+}
+#endif
+
+/* Puts worker number i, which accepts connections from servfd, where the
+   affinity policy says it should be */
+void place_worker(int i, int servfd) {
+  int cpu = i % MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+  worker_id = i;
+
+  switch(affinity) {
+  case AFFINITY_CORE:
+  case AFFINITY_INCOMING:
+    if(pin_to_cpu(cpu) == -1) {
+      log_text(err, "Unable to pin worker %d to CPU %d: %s", i, cpu,
+               strerror(errno));
+      break;
+    }
+
+#ifdef SO_INCOMING_CPU
+    /* the kernel prefers the SO_REUSEPORT socket that asked for the CPU that
+       the connection arrived on */
+    if(affinity == AFFINITY_INCOMING &&
+       setsockopt(servfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                  sizeof(cpu)) == -1)
+      log_text(err, "Unable to set SO_INCOMING_CPU for worker %d: %s", i,
+               strerror(errno));
+#endif
+    break;
+
+  case AFFINITY_NUMA:
+#ifdef __linux__
+    if(bind_to_node(i) == -1)
+      log_text(err, "Unable to bind worker %d to a NUMA node: %s", i,
+               strerror(errno));
+#endif
+    break;
+  }
+}
+
+/* Counts the new connection on fd in worker_stats */
+void count_connection(int fd) {
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+  socklen_t len = sizeof(int);
+  int cpu;
+
+  if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+     cpu == sched_getcpu())
+    worker_stats.local++;
+#endif
+
+  worker_stats.connections++;
+}
+
+/* signal handler for SIGUSR1 */
+void request_stats(int sig) {
+  stats_wanted = 1;
+}
+
+/* Logs this worker's stats */
+void log_stats(void) {
+  stats_wanted = 0;
+
+  if(worker_id == -1) return;
+
+  log_text(out, "Worker %d (pid %d, %s affinity): %lu connections, %lu of "
+           "them arrived on the worker's CPU, %lu requests, %lu timeouts.",
+           worker_id, (int)getpid(), affinity_name[affinity],
+           worker_stats.connections, worker_stats.local, worker_stats.requests,
+           worker_stats.timeouts);
+}
@@ -0,0 +1,155 @@
+/* Per-request memory for serve
+
+   Everything that belongs to a request is allocated from an arena, by moving
+   a pointer along a block of memory, and it's all freed together by handing
+   the blocks back when the request is finished. The blocks are kept for the
+   next request rather than being freed, so once a process is warmed up its
+   requests don't need malloc() or free() at all. Anything too big for a block
+   gets a block of its own, which is freed with the arena.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+/* alignment of everything allocated from an arena */
+#define ARENA_ALIGN (2 * sizeof(void*))
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* the blocks' headers take up the start of them */
+#define BLOCK_START ALIGN(sizeof(arena_block))
+
+struct arena_block_s {
+  arena_block *next;/* the block that filled up before this one */
+  size_t size;
+  size_t used;
+};
+
+/* blocks of ARENA_SIZE that are waiting to be used again */
+static arena_block *spare;
+static int num_spare;
+
+/* the most that can be asked for at once without the sizes wrapping round */
+#define ARENA_MAX ((size_t)-1 - BLOCK_START - ARENA_ALIGN)
+
+/* Returns a new block with room for at least n bytes, or NULL if there isn't
+   enough memory */
+static arena_block *new_block(size_t n) {
+  arena_block *b;
+
+  if(n <= ARENA_SIZE - BLOCK_START && spare) {
+    b = spare;
+    spare = b->next;
+    num_spare--;
+  } else {
+    if(n > ARENA_MAX) return NULL;
+    n = MAX(ALIGN(n) + BLOCK_START, ARENA_SIZE);
+    if(!(b = malloc(n))) return NULL;
+    b->size = n;
+  }
+
+  b->next = NULL;
+  b->used = BLOCK_START;
+
+  return b;
+}
+
+/* Returns a new, empty arena */
+arena *new_arena(void) {
+  arena_block *b = new_block(sizeof(arena));
+  arena *a;
+
+  if(!b) {
+    log_text(err, "Unable to allocate memory for a request.");
+    exit(1);
+  }
+
+  a = (arena*)((char*)b + b->used);
+
+  b->used += ALIGN(sizeof(arena));
+  a->block = b;
+  a->top = NULL;
+
+  return a;
+}
+
+/* Hands back everything allocated from a (including a itself) */
+void free_arena(arena *a) {
+  arena_block *b, *next;
+
+  for(b = a->block; b; b = next) {
+    next = b->next;
+
+    /* only standard blocks are worth keeping */
+    if(b->size == ARENA_SIZE && num_spare < MAX_SPARE_BLOCKS) {
+      b->next = spare;
+      spare = b;
+      num_spare++;
+    } else {
+      free(b);
+    }
+  }
+}
+
+/* Returns n bytes of memory from a, or NULL if there isn't enough; only
+   something as big as a client says it's going to send can be that big */
+void *arena_alloc(arena *a, size_t n) {
+  arena_block *b = a->block;
+  void *p;
+
+  if(b->size - b->used < n) {
+    if(!(b = new_block(n))) return NULL;
+
+    /* a big block goes behind the current one, so that the room left in that
+       can still be used */
+    if(n > ARENA_SIZE - BLOCK_START) {
+      b->next = a->block->next;
+      a->block->next = b;
+    } else {
+      b->next = a->block;
+      a->block = b;
+    }
+  }
+
+  p = (char*)b + b->used;
+  b->used += ALIGN(n);
+  a->top = (b == a->block) ? p : NULL;
+
+  return p;
+}
+
+/* Makes the n byte piece of memory at p, the last thing allocated from a,
+   bigger, or moves it somewhere with room for it to be, and returns where it
+   is now. p can be NULL, to allocate new memory */
+void *arena_grow(arena *a, void *p, size_t old, size_t n) {
+  arena_block *b = a->block;
+  void *q;
+
+  /* the last thing in the block can just take up more of it */
+  if(p && p == a->top && n <= b->size - ((char*)p - (char*)b)) {
+    b->used = (char*)p - (char*)b + ALIGN(n);
+    return p;
+  }
+
+  if(!(q = arena_alloc(a, n))) return NULL;
+  if(p) memcpy(q, p, old);
+
+  return q;
+}
+
+/* Returns a copy of the n bytes at s, with a NUL after them, allocated from
+   a */
+char *arena_strndup(arena *a, const char *s, size_t n) {
+  char *p = arena_alloc(a, n + 1);
+
+  memcpy(p, s, n);
+  p[n] = '\0';
+
+  return p;
+}
+
+/* Returns a copy of the string s allocated from a */
+char *arena_strdup(arena *a, const char *s) {
+  return arena_strndup(a, s, strlen(s));
+}
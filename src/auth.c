@@ -42,7 +42,6 @@ int authenticated(request *r) {
   int lenpassword;
   char md5data[16];
   char *realmd5;
-  int i;
   MD5_CTX ctx;
 
   /* no auth required if they're not getting a page */
@@ -69,21 +68,21 @@ int authenticated(request *r) {
   }
 
   /* now see what auth data the client sent */
-  for(i = 0; i < r->num_headers; i++) {
-    if(strcasecmp(r->header_list[i].name, "Authorization") == 0) {
-      get_authdata(r->header_list[i].value, &user, &secret_password);
-      /* we don't want passwords being swapped to disk! */
-      lenpassword = strlen(secret_password);
+  if(r->headers.known[HEADER_AUTHORIZATION]) {
+    get_authdata(r->headers.known[HEADER_AUTHORIZATION], &user,
+                 &secret_password);
+    /* we don't want passwords being swapped to disk! */
+    lenpassword = strlen(secret_password);
 #ifdef USE_MLOCK
-      mlock(secret_password, lenpassword);
+    mlock(secret_password, lenpassword);
 #endif
-      break;
-    }
   }
 
   /* get authentication realm */
-  if(r->auth_realm) free(r->auth_realm);
-  r->auth_realm = stripendl(nextline(fd));
+  if((line = stripendl(nextline(fd)))) {
+    r->auth_realm = arena_strdup(r->arena, line);
+    free(line);
+  }
 
   /* now get md5 hash */
   if(user && secret_password) {
@@ -104,7 +103,9 @@ int authenticated(request *r) {
             if(memcmp(realmd5, md5data, 16) == 0) {/* correct password */
               close(fd);
               free(fname);
-              r->auth_user = user;
+              r->auth_user = arena_strdup(r->arena, user);
+              free(user);
+              free(line);
               /* don't store passwords... */
               memset(secret_password, '\0', lenpassword);
               free(secret_password);
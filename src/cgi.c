@@ -70,7 +70,7 @@ void setup_env(char ***env, request *r) {
   if(r->file[0] != '/') {/* make a path name for relative directories */
     len = strlen(r->doc_root);
     len2 = strlen(r->file);
-    pathname = malloc(len + 1 + len2 + 1);
+    pathname = arena_alloc(r->arena, len + 1 + len2 + 1);
     strcpy(pathname, r->doc_root);
     if(pathname[len - 1] != '/') {/* add a slash */
       pathname[len] = '/';
@@ -79,7 +79,6 @@ void setup_env(char ***env, request *r) {
       strcpy(pathname + len, r->file);
     }
     add_env(env, num++, "SCRIPT_FILENAME", pathname);
-    free(pathname);
     len = 0;
     len2 = 0;
   } else {
@@ -88,34 +87,37 @@ void setup_env(char ***env, request *r) {
 
   ptr = strchr(r->reqfile, '?');
   add_env(env, num++, "QUERY_STRING", ptr ? ptr+1 : "");
-  if(ptr)	scriptname = strdup2(r->reqfile, ptr - r->reqfile);
-  else scriptname = strdup(r->reqfile);
+  if(ptr)	scriptname = arena_strndup(r->arena, r->reqfile, ptr - r->reqfile);
+  else scriptname = r->reqfile;
   add_env(env, num++, "SCRIPT_NAME", scriptname);
-  free(scriptname);
 
   /* now the HTTP headers */
-  for(i = 0; i < r->num_headers; i++) {
+  for(i = 0; i < r->headers.num; i++) {
     /* make it long enough */
-    len2 = 6 + strlen(r->header_list[i].name);
+    len2 = 6 + r->headers.list[i].name_len;
     if(len2 > len) {
       len = len2;
       header = realloc(header, len);
       strcpy(header, "HTTP_");
     }
-    strcpy(header + 5, r->header_list[i].name);
+    strcpy(header + 5, r->headers.list[i].name);
     /* fix case and hyphenation */
     for(ptr = header + 5; *ptr; ptr++) {
       *ptr = toupper(*ptr);
       if(*ptr == '-') *ptr = '_';
     }
-    add_env(env, num++, header, r->header_list[i].value);
+    add_env(env, num++, header, r->headers.list[i].value);
     /* and check some special ones */
-    if(strcmp(header, "HTTP_CONTENT_LENGTH") == 0) {
-      add_env(env, num++, "CONTENT_LENGTH", r->header_list[i].value);
-    } else if(strcmp(header, "HTTP_CONTENT_TYPE") == 0) {
-      add_env(env, num++, "CONTENT_TYPE", r->header_list[i].value);
-    } else if(strcmp(header, "HTTP_HOST") == 0) {
-      add_env(env, num++, "SERVER_NAME", r->header_list[i].value);
+    switch(r->headers.list[i].id) {
+    case HEADER_CONTENT_LENGTH:
+      add_env(env, num++, "CONTENT_LENGTH", r->headers.list[i].value);
+      break;
+    case HEADER_CONTENT_TYPE:
+      add_env(env, num++, "CONTENT_TYPE", r->headers.list[i].value);
+      break;
+    case HEADER_HOST:
+      add_env(env, num++, "SERVER_NAME", r->headers.list[i].value);
+      break;
     }
   }
   free(header);
@@ -124,17 +126,19 @@ void setup_env(char ***env, request *r) {
 /* Runs the CGI script with the given handler */
 void run_cgi(request *r) {
   char **env = NULL;
-  char buf[1024];
   char *line = NULL;
   char *ptr;
-  unsigned long len = 0;
   int n;
   char *handler = r->content_type;
-  header *header_list = NULL;
-  int num_headers = 0;
+  headers hdrs;
+  char *block = NULL;
+  size_t size = 0;
+  int nph = 0;
+  int complete = 0;
   char *sent = NULL;
   int fildes[2];/* 0 is for parent to read from, 1 is for child to write to */
   long long clength = -1;
+  size_t length = -1;/* the Content-Length header's, if there is one */
 
   /* make a socket to send the post data and cgi output down */
   if(socketpair(AF_UNIX, SOCK_STREAM, 0, fildes) < 0) {
@@ -168,53 +172,63 @@ void run_cgi(request *r) {
 
   /* sort out headers that don't apply to CGI scripts */
   r->content_length = 0;
-  free(r->last_modified);
   r->last_modified = NULL;
 
-  /* read headers until there's a blank line */
-  while((n = next_header(fildes[0], &line, &header_list, num_headers++,
-                         (size_t *)&clength)) > 0);
+  /* read headers until there's a blank line, unless the first line isn't a
+     header at all */
+  while((line = nextline(fildes[0]))) {
+    n = strlen(line);
+    block = realloc(block, size + n + 1);
+    strcpy(block + size, line);
+    size += n;
+    free(line);
+
+    if(headers_length(block + size - n, n)) {
+      complete = 1;
+      break;
+    }
+    if(size == n && !strchr(block, ':')) {
+      nph = 1;
+      break;
+    }
+  }
 
   /* sort out header errors */
-  if(n == -1) {/* bad headers; non-parsed header script? */
-    if(strncmp(line, "HTTP/", 4) != 0) {
+  if(nph) {/* bad headers; non-parsed header script? */
+    if(strncmp(block, "HTTP/", 4) != 0) {
       log_text(err, "%s printed a bad header.", r->file);
     }
-    send_str(r->fd, line);
+    send_str(r->fd, stripendl(block));
     send_str(r->fd, "\r\n");
-    free(line);
-  } else if(n == -2) {/* premature close of file descriptor */
-    log_text(err, "Premature exit by %s while collecting header %d.",
-             handler[1] ? handler : r->file, num_headers);
+  } else if(!complete) {/* premature close of file descriptor */
+    log_text(err, "Premature exit by %s while collecting headers.",
+             handler[1] ? handler : r->file);
     r->status = 500;
     send_errorpage(r);
-    free_headers(header_list, num_headers-1);
+    free(block);
     close(fildes[0]);
     return;
   }
 
-  /* next_header didn't add a header if it returned a value < 0 */
-  if(n < 0) num_headers--;
+  /* the script's headers are looked at where they are, like a client's */
+  memset(&hdrs, '\0', sizeof(hdrs));
+  if(complete) parse_headers(&hdrs, block, size, &length);
+  if(length <= LLONG_MAX) clength = length;
 
-  if(n == -1) {/* this is a non-parsed-header script */
-    do {
-      while((len = read(fildes[0], buf, 1024)) > 0)
-        send(r->fd, buf, len, 0);
-    } while(len == -1 && errno == EINTR);
+  if(nph) {/* this is a non-parsed-header script */
+    send_stream(r->fd, fildes[0]);
     r->close_conn = 1;/* NPH scripts are more reliable if the connection ends */
   } else {
     /* fill in the headers the script gave us */
-    sent = malloc(num_headers);
+    sent = malloc(hdrs.num);
 
     /* fill_headers returns the content of the Location header */
-    if((ptr = fill_headers(r, header_list, num_headers, sent))) {
+    if((ptr = fill_headers(r, &hdrs, sent))) {
       /* Location header was sent, redirect */
       if(*ptr == '/') {/* local redirect, handle it ourselves */
-	free(r->file);
-	free(r->reqfile);
 	r->status = 200;
 	r->reqfile = ptr;
-	r->file = filename(ptr);
+	r->file = filename(r->arena, ptr);
 	file_stuff(r);
 	send_file(r);
       } else {/* not a local redirect, send it to the client */
@@ -225,12 +239,12 @@ void run_cgi(request *r) {
     } else {/* no location header, send script output */
       r->content_length = 0;
 
-      send_gzipped(r, fildes[0], NOT_MMAPABLE, clength, header_list,
-                   num_headers, sent);
+      send_gzipped(r, fildes[0], NOT_MMAPABLE, clength, &hdrs, sent);
     }
   }
 
-  free_headers(header_list, num_headers);
+  free_headers(&hdrs);
+  free(block);
   free(sent);
 }
 
@@ -249,7 +263,6 @@ void write_post_data(int fd, request *r) {
 void exec_script(int *fildes, char * const *env, request *r) {
   char *path;
   char *ptr;
-  char *tmp;
   char *handler = r->content_type;
 
   close(fildes[0]);/* don't want parents end */
@@ -259,8 +272,7 @@ void exec_script(int *fildes, char * const *env, request *r) {
   dup2(fildes[1], STDOUT_FILENO);
 
   /* now go in to the script's directory */
-  tmp = strdup(r->file);
-  path = tmp;
+  path = arena_strdup(r->arena, r->file);
 
   /* strip everything after the right-most slash */
   if((ptr = strrchr(path, '/'))) {
@@ -281,59 +293,44 @@ void exec_script(int *fildes, char * const *env, request *r) {
              strerror(errno));
   }
 
-  free(tmp);
   close(fildes[1]);
   exit(1);
 }
 
-/* sends headers down fd where the corresponding byte in sent is 0.
-   There are never enough headers to warrant a bit array for sent */
-void send_new_headers(header *header_list, int num_headers, char *sent,
-                      int fd) {
-  int i;
-
-  for(i = 0; i < num_headers; i++) {
-    /* go through headers not sent already */
-    if(!sent[i]) {
-      send_str(fd, header_list[i].name);
-      send_str(fd, ": ");
-      send_str(fd, header_list[i].value);
-      send_str(fd, "\r\n");
-      sent[i] = 1;
-    }
-  }
-}
-
 /* Fills in request structure headers from the header list
    A byte in done is set to 0 if that header does not go in a request structure
    field.
    Returns the content of the Location header, or NULL if there was none */
-char *fill_headers(request *r, header *header_list, int num_headers,
-                   char *done) {
+char *fill_headers(request *r, headers *h, char *done) {
   int i;
   char *s = NULL;
 
-  memset(done, 1, num_headers);
-
-  for(i = 0; i < num_headers; i++) {
-    if(strcasecmp(header_list[i].name, "Content-Type") == 0) {
-      free(r->content_type);
-      r->content_type = strdup(header_list[i].value);
-    } else if(strcasecmp(header_list[i].name, "Content-Length") == 0) {
-      r->content_length = strtoull(header_list[i].value, NULL, 10);
-    } else if(strcasecmp(header_list[i].name, "Date") == 0) {
-      free(r->date);
-      r->date = strdup(header_list[i].value);
-    } else if(strcasecmp(header_list[i].name, "Last-Modified") == 0) {
-      free(r->last_modified);
-      r->last_modified = strdup(header_list[i].value);
-    } else if(strcasecmp(header_list[i].name, "Status") == 0) {
-      r->status = atoi(header_list[i].value);
-    } else if(strcasecmp(header_list[i].name, "Location") == 0) {
-      free(s);/* get rid of the old one */
-      s = strdup(header_list[i].value);
-    } else if((strcasecmp(header_list[i].name, "Server") != 0) &&
-              (strcasecmp(header_list[i].name, "Connection") != 0)) {
+  memset(done, 1, h->num);
+
+  for(i = 0; i < h->num; i++) {
+    switch(h->list[i].id) {
+    case HEADER_CONTENT_TYPE:
+      r->content_type = arena_strdup(r->arena, h->list[i].value);
+      break;
+    case HEADER_CONTENT_LENGTH:
+      r->content_length = strtoull(h->list[i].value, NULL, 10);
+      break;
+    case HEADER_DATE:
+      r->date = arena_strdup(r->arena, h->list[i].value);
+      break;
+    case HEADER_LAST_MODIFIED:
+      r->last_modified = arena_strdup(r->arena, h->list[i].value);
+      break;
+    case HEADER_STATUS:
+      r->status = atoi(h->list[i].value);
+      break;
+    case HEADER_LOCATION:
+      s = arena_strdup(r->arena, h->list[i].value);
+      break;
+    case HEADER_SERVER:
+    case HEADER_CONNECTION:
+      break;
+    default:
       /* send what the script says instead of letting send_headers do it */
       done[i] = 0;
     }
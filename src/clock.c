@@ -0,0 +1,213 @@
+/* Clock for serve
+
+   Every response has the date in it, and every line of the logs starts with
+   it, but it only changes once a second. The clock keeps both ready formatted
+   for the current second, so that they're only worked out again when the
+   second changes, and dates are formatted by hand instead of by strftime().
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+static const char *day_name[] = {
+  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char *month_name[] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static time_t clock_time = -1;/* the second that the strings below are for */
+static char http_str[HTTP_DATE_SIZE];
+static char log_str[LOG_DATE_SIZE];
+
+/* Writes n as two digits at p, and returns the end of them */
+static char *put2(char *p, int n) {
+  p[0] = '0' + n / 10;
+  p[1] = '0' + n % 10;
+
+  return p + 2;
+}
+
+/* Writes tm at p like "Sun<sep>06 Nov 1994 08:49:37", and returns the end of
+   it, or NULL if the year won't fit in 4 digits */
+static char *put_date(char *p, const struct tm *tm, char *sep) {
+  int year = tm->tm_year + 1900;
+
+  if(year < 0 || year > 9999) return NULL;
+
+  memcpy(p, day_name[tm->tm_wday], 3);
+  p += 3;
+  while(*sep) *p++ = *sep++;
+  p = put2(p, tm->tm_mday);
+  *p++ = ' ';
+  memcpy(p, month_name[tm->tm_mon], 3);
+  p += 3;
+  *p++ = ' ';
+  p = put2(p, year / 100);
+  p = put2(p, year % 100);
+  *p++ = ' ';
+  p = put2(p, tm->tm_hour);
+  *p++ = ':';
+  p = put2(p, tm->tm_min);
+  *p++ = ':';
+  p = put2(p, tm->tm_sec);
+
+  return p;
+}
+
+/* Writes t to buf, which must have room for HTTP_DATE_SIZE bytes, as an HTTP
+   date (eg. "Sun, 06 Nov 1994 08:49:37 GMT") */
+void http_date(time_t t, char *buf) {
+  struct tm tm;
+  char *p;
+
+  if(t == clock_time) {
+    memcpy(buf, http_str, HTTP_DATE_SIZE);
+    return;
+  }
+
+  gmtime_r(&t, &tm);
+
+  if((p = put_date(buf, &tm, ", "))) strcpy(p, " GMT");
+  else strftime(buf, HTTP_DATE_SIZE, "%a, %d %b %Y %T GMT", &tm);
+}
+
+/* Reads a number of between min and max digits at *p in to *n, and moves *p
+   past it.
+   Returns 0 on success, or -1 if there aren't enough digits */
+static int get_num(const char **p, int min, int max, int *n) {
+  int i;
+
+  *n = 0;
+  for(i = 0; i < max && isdigit((unsigned char)**p); i++, (*p)++)
+    *n = *n * 10 + **p - '0';
+
+  return (i >= min) ? 0 : -1;
+}
+
+/* Reads a month name at *p, and moves *p past it.
+   Returns the month (0 to 11), or -1 if there isn't one */
+static int get_month(const char **p) {
+  int i;
+
+  for(i = 0; i < 12; i++) {
+    if(strncasecmp(*p, month_name[i], 3) == 0) {
+      *p += 3;
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Returns the number of days from 1 Jan 1970 to the given day (month from 1
+   to 12) */
+static long days_from_civil(long year, int month, int day) {
+  long era, yoe, doy;
+
+  /* count from March, so that leap days come at the end of the year */
+  year -= (month <= 2);
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* returns a time_t that is the date described by str, which can be in any of
+   the formats that HTTP allows:
+     "Sun, 06 Nov 1994 08:49:37 GMT" (the one we send)
+     "Sunday, 06-Nov-94 08:49:37 GMT"
+     "Sun Nov  6 08:49:37 1994"
+   The date is always GMT, whatever the local time zone.
+   Returns 0 if str isn't a date */
+time_t get_date(const char *str) {
+  const char *p = str;
+  int day, month, year = 0, hour, min, sec;
+  int asctime = 0;
+
+  /* the day of the week doesn't matter, but what comes after it says which
+     format it is */
+  while(isalpha((unsigned char)*p)) p++;
+
+  if(*p == ',') {
+    for(p++; *p == ' '; p++);
+    if(get_num(&p, 1, 2, &day) == -1) return 0;
+
+    if(*p == ' ') {/* "06 Nov 1994" */
+      p++;
+      if((month = get_month(&p)) == -1 || *p++ != ' ') return 0;
+      if(get_num(&p, 4, 4, &year) == -1) return 0;
+    } else if(*p == '-') {/* "06-Nov-94" */
+      p++;
+      if((month = get_month(&p)) == -1 || *p++ != '-') return 0;
+      if(get_num(&p, 2, 2, &year) == -1) return 0;
+      year += (year < 69) ? 2000 : 1900;
+    } else {
+      return 0;
+    }
+  } else if(*p == ' ') {/* "Nov  6", and the year comes at the end */
+    p++;
+    if((month = get_month(&p)) == -1 || *p != ' ') return 0;
+    for(; *p == ' '; p++);
+    if(get_num(&p, 1, 2, &day) == -1) return 0;
+    asctime = 1;
+  } else {
+    return 0;
+  }
+
+  /* then the time */
+  if(*p++ != ' ') return 0;
+  if(get_num(&p, 1, 2, &hour) == -1 || *p++ != ':') return 0;
+  if(get_num(&p, 1, 2, &min) == -1 || *p++ != ':') return 0;
+  if(get_num(&p, 1, 2, &sec) == -1) return 0;
+
+  if(asctime) {
+    for(; *p == ' '; p++);
+    if(get_num(&p, 4, 4, &year) == -1) return 0;
+  }
+
+  if(day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) return 0;
+
+  return (time_t)days_from_civil(year, month + 1, day) * 86400 +
+    hour * 3600 + min * 60 + sec;
+}
+
+/* Brings the clock up to date, if the second has changed since it was last
+   looked at */
+static void tick(void) {
+  struct tm tm;
+  time_t t;
+  char *p;
+
+  if((t = time(NULL)) == clock_time) return;
+
+  /* http_date() would use the old string if clock_time was set already */
+  http_date(t, http_str);
+
+  localtime_r(&t, &tm);
+  log_str[0] = '[';
+  if((p = put_date(log_str + 1, &tm, " "))) strcpy(p, "]");
+  else strftime(log_str, LOG_DATE_SIZE, "[%a %d %b %Y %T]", &tm);
+
+  clock_time = t;
+}
+
+/* Returns the current time as an HTTP date, for a Date header. The string is
+   changed when the second does */
+const char *http_now(void) {
+  tick();
+
+  return http_str;
+}
+
+/* Returns the current local time as it goes at the start of a line in the
+   logs. The string is changed when the second does */
+const char *log_now(void) {
+  tick();
+
+  return log_str;
+}
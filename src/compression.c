@@ -4,36 +4,48 @@
 
 #include "serve.h"
 
-char *encoding_name[] = { "identity", "gzip" };
+char *encoding_name[] = { "identity", "gzip", "br", "zstd" };
 
-/* decides what encoding to use (gzip or plain) based on the content of the
-   accept-encoding header. Will either return IDENTITY or GZIP. Gzip will
-   always be favoured over identity if it is acceptable */
-int get_encoding(const char *accept_encoding) {
-#ifdef USE_GZIP
+/* what a copy of a file that's been compressed in advance is called, after
+   the name of the file */
+char *encoding_suffix[] = { "", ".gz", ".br", ".zst" };
+
+/* the encodings to use copies in, the one that usually comes out smallest
+   first */
+static int copy_order[] = { BROTLI, ZSTD, GZIP };
+
+/* Returns the encodings that the given Accept-Encoding header says are
+   acceptable, as a set of ENCODING() bits; if the header is garbage, it's
+   taken as saying that nothing but identity is */
+int get_encodings(const char *accept_encoding) {
   const char *p = accept_encoding;
   const char *s;
-  char *coding = NULL;
-  char *qvalue;
+  const char *coding;
+  size_t coding_len;
+  char qvalue[16];
+  int encodings = 0;
+  size_t n;
   float q;
-  
+  int i;
+
   while(*p) {
     /* skip comma */
     if(*p == ',') p++;
 
     /* skip whitespace */
     for(; *p && iswhite(*p); p++);
-    if(!*p) goto identity;
+    if(!*p) break;
 
     /* if it's not a real name, we have been supplied garbage or the parser
        has failed; just send it un-compressed */
-    if(!isalnum(*p) && *p != '*' && *p != '-') goto identity;
+    if(!isalnum(*p) && *p != '*' && *p != '-') return 0;
 
     /* find end of coding name */
     for(s = p; *s && (isalnum(*s) || *s == '*' || *s == '-'); s++);
 
     /* get coding name */
-    coding = strdup2(p, s - p);
+    coding = p;
+    coding_len = s - p;
 
     /* skip whitespace */
     for(p = s; *p && iswhite(*p); p++);
@@ -41,64 +53,167 @@ int get_encoding(const char *accept_encoding) {
     if(*p == ';') {/* qvalue here */
       /* skip whitespace */
       for(p++; *p && iswhite(*p); p++);
-      if(!*p) goto identity;
+      if(!*p) return 0;
 
       /* pretend this is a 'q' */
       p++;
 
       /* skip whitespace */
       for(; *p && iswhite(*p); p++);
-      if(!*p) goto identity;
+      if(!*p) return 0;
       
       /* pretend this is an '=' */
       p++;
 
       /* skip whitespace */
       for(; *p && iswhite(*p); p++);
-      if(!*p) goto identity;
+      if(!*p) return 0;
 
       /* now read the q-value */
       for(s = p; *s && (isdigit(*s) || *s == '.' || *s == '-'); s++);
 
       /* get q value */
-      qvalue = strdup2(p, s - p);
+      n = MIN(s - p, sizeof(qvalue) - 1);
+      memcpy(qvalue, p, n);
+      qvalue[n] = '\0';
       q = atof(qvalue);
-      free(qvalue);
+      p = s;
 
       /* don't check for encoding type if this encoding is unacceptable */
-      if(q <= 0.0) {
-        free(coding);
-        continue;
-      }
+      if(q <= 0.0) continue;
     }
 
     /* if we're here, then this coding is acceptable */
-    if(strcasecmp(coding, "gzip") == 0) {
-      free(coding);
-      return GZIP;
-    }
-
-    free(coding);
-    coding = NULL;
+    for(i = GZIP; i < ENCODINGS; i++)
+      if(coding_len == strlen(encoding_name[i]) &&
+         strncasecmp(coding, encoding_name[i], coding_len) == 0)
+        encodings |= ENCODING(i);
   }
 
-  /* this is goto'd whenever we reach the end of the string */
- identity:
-  free(coding);
+  return encodings;
+}
+
+/* decides what encoding to use when compressing on the fly (gzip or plain),
+   given the acceptable encodings from get_encodings(). Will either return
+   IDENTITY or GZIP. Gzip will always be favoured over identity if it is
+   acceptable */
+int get_encoding(int encodings) {
+#ifdef USE_GZIP
+  if(encodings & ENCODING(GZIP)) return GZIP;
 #endif
 
   /* we haven't found gzip acceptable, just go with identity */
   return IDENTITY;
 }
 
+/* Returns 1 if the file that a was got from stat()ing was modified before
+   the one that b was, or 0 if not */
+static int older(const struct stat *a, const struct stat *b) {
+#ifdef __linux__
+  if(a->st_mtime == b->st_mtime)
+    return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec;
+#endif
+
+  return a->st_mtime < b->st_mtime;
+}
+
+/* Empties copies, without closing anything */
+void no_copies(compressed_copies *copies) {
+  int i;
+
+  copies->known = 0;
+  for(i = 0; i < ENCODINGS; i++) copies->fildes[i] = -1;
+}
+
+/* Closes the files in copies, and empties it */
+void close_copies(compressed_copies *copies) {
+  int i;
+
+  for(i = 0; i < ENCODINGS; i++)
+    if(copies->fildes[i] != -1) close(copies->fildes[i]);
+
+  no_copies(copies);
+}
+
+/* Opens the copies of the file at path (which stat() said statbuf about) that
+   were compressed in advance, which are called path with the encoding's suffix
+   on the end, and puts them in copies. A copy that's older than the file is
+   left out, since it must be of an older version of it. This blocks, so an
+   event loop gets the filesystem pool to do it */
+void find_copies(const char *path, const struct stat *statbuf,
+                 compressed_copies *copies) {
+  size_t len = strlen(path);
+  char copy[PATH_MAX + 5];
+  int enc;
+
+  no_copies(copies);
+  copies->known = 1;
+  if(len > PATH_MAX) return;
+
+  memcpy(copy, path, len);
+  for(enc = GZIP; enc < ENCODINGS; enc++) {
+    /* opening it is no slower than stat()ing it, and it's needed anyway */
+    strcpy(copy + len, encoding_suffix[enc]);
+    if((copies->fildes[enc] = open(copy, O_RDONLY | O_CLOEXEC)) == -1)
+      continue;
+
+    if(fstat(copies->fildes[enc], &copies->statbuf[enc]) == -1 ||
+       !S_ISREG(copies->statbuf[enc].st_mode) ||
+       older(&copies->statbuf[enc], statbuf)) {
+      close(copies->fildes[enc]);
+      copies->fildes[enc] = -1;
+    }
+  }
+}
+
+/* If there's a copy of the file for the given request that was compressed in
+   advance (see find_copies()), in an encoding that the client accepts, it's
+   what gets sent: r->file, r->fildes, r->statbuf and r->content_length become
+   the copy's and r->encoding its encoding. The content type and Last-Modified
+   date stay the file's.
+   Returns 1 if there was a copy to use, or 0 if not */
+int use_precompressed(request *r) {
+  size_t len;
+  int enc;
+  int i;
+
+  if(!r->accept_encodings || !r->copies.known) return 0;
+
+  for(i = 0; i < sizeof(copy_order) / sizeof(copy_order[0]); i++) {
+    enc = copy_order[i];
+    if(!(r->accept_encodings & ENCODING(enc)) || r->copies.fildes[enc] == -1)
+      continue;
+
+    len = strlen(r->file);
+    r->stat_file = arena_alloc(r->arena, len + 5);
+    memcpy(r->stat_file, r->file, len);
+    strcpy(r->stat_file + len, encoding_suffix[enc]);
+    r->file = r->stat_file;
+
+    if(r->fildes != -1) close(r->fildes);
+    r->fildes = r->copies.fildes[enc];
+    r->read_ahead = 0;
+    r->copies.fildes[enc] = -1;
+    r->statbuf = r->copies.statbuf[enc];
+    r->content_length = r->statbuf.st_size;
+    r->encoding = enc;
+    r->precompressed = 1;
+    r->body = NULL;/* that's the file, not the copy */
+
+    return 1;
+  }
+
+  return 0;
+}
+
 /* sends a deflated copy of the given data if the encoding is GZIP, otherwise
-   it sends it plain; you can give a list of headers, the number of them,
-   and an array saying which have been sent if you want extra headers to be
-   sent; See cgi.c. Set mmapable to non-zero if sendfile() can be used to send
-   data from the given file descriptor to a socket.
+   it sends it plain; you can give some headers and an array saying which
+   have been sent if you want extra headers to be sent; See cgi.c. Set
+   mmapable to non-zero if the given file descriptor is a file, rather than a
+   pipe or socket, so that it can be sent with sendfile().
    Set len as -1 if you don't know it*/
 void send_gzipped(request *r, int fd, int mmapable, long long len,
-                  header *header_list, int num_headers, char *sent) {
+                  headers *h, char *sent) {
   char buf[GZIP_BUF_SIZE];
   int read_data = 0;
   int fildes = -1;
@@ -248,53 +363,29 @@ void send_gzipped(request *r, int fd, int mmapable, long long len,
 
  send_data:
 
-  /* now start sending stuff */
-  send_headers(r);
-
-  /* HACK: Let CGI scripts send extra headers */
-  if(header_list) {
-    send_new_headers(header_list, num_headers, sent, r->fd);
-  }
-
-  send_str(r->fd, "\r\n");
-
-  /* if we've already read some data, write that first */
-  if(read_data && fildes == fd) {
-    send(r->fd, buf, len_data, 0);
-  }
+  /* now start sending stuff, with the CGI script's extra headers if there
+     are any, and the data we've already read if there is some */
+  if(read_data && fildes == fd && r->meth != HEAD)
+    send_headers(r, h, sent, buf, len_data, 1);
+  else
+    send_headers(r, h, sent, NULL, 0, r->meth != HEAD);
 
-  /* only send data if it wasn't a HEAD request */
+  /* only send data if it wasn't a HEAD request; a file (including the
+     temporary one) is sent from where it's got to, and anything else until it
+     ends */
   if(r->meth != HEAD) {
-#ifdef USE_SENDFILE
-    /* If we're allowed sendfile and it's possible, try */
-    if(!mmapable ||
-       sendfile(fildes, r->fd, NULL, r->content_length) == -1) {
-#endif
-      /* Either not allowed sendfile or it's not possible */
-      do {
-        while((len = read(fildes, buf, GZIP_BUF_SIZE)) > 0) {
-          if(send(r->fd, buf, len, 0) == -1) {
-            /* some error sending */
-            log_text(err, "send: %s", strerror(errno));
-            r->close_conn = 1;
-            goto cleanup;
-          }
-        }
-      } while(len == -1 && errno == EINTR);
-
-      /* some other error */
-      if(len == -1) {
-        log_text(err, "Failed to read data from temporary file: %s",
-                 strerror(errno));
-        r->close_conn = 1;
-      }
-#ifdef USE_SENDFILE
+    if(mmapable || fildes != fd)
+      n = send_file_range(r->fd, fildes, lseek(fildes, 0, SEEK_CUR),
+                          r->content_length);
+    else
+      n = send_stream(r->fd, fildes);
+
+    if(n == -1) {
+      log_text(err, "Failed to send %s: %s", r->file, strerror(errno));
+      r->close_conn = 1;
     }
-#endif
   }
 
- cleanup:
-
 #ifdef USE_GZIP
   if(gzstrm) gzclose(gzstrm);
   else
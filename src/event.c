@@ -0,0 +1,661 @@
+/* Event-driven connection handling for serve
+
+   Instead of a process per connection, each connection is a small state
+   machine driven by epoll: reading the request line, reading the headers, and
+   then sending the queued response. Anything that touches the filesystem is
+   given to the filesystem pool (see fspool.c) first, and responses that need
+   to block (CGI scripts, gzip, POST data) are handed off to a handler
+   process. The io_uring engine (see uring.c) drives the same state machine.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+/* Sets or clears O_NONBLOCK on fd; returns 0 on success and -1 on error */
+int set_nonblocking(int fd, int nonblocking) {
+  int flags;
+
+  if((flags = fcntl(fd, F_GETFL)) == -1) return -1;
+
+  if(nonblocking) flags |= O_NONBLOCK;
+  else flags &= ~O_NONBLOCK;
+
+  return fcntl(fd, F_SETFL, flags);
+}
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+
+/* maximum number of events to deal with per call to epoll_wait() */
+#define MAXEVENTS 64
+
+static int epfd = -1;
+static int listenfd = -1;
+static int fsfd = -1;/* readable when the filesystem pool has finished jobs */
+static connection *conns;/* all open connections, for timeouts */
+
+/* Changes the events that we're waiting for on the connection */
+static void watch(connection *c, uint32_t events) {
+  struct epoll_event ev;
+
+  if(events == c->events) return;
+  c->events = events;
+
+  memset(&ev, '\0', sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Gets ready to handle connections from servfd, and starts the filesystem
+   pool.
+   Returns a file descriptor that becomes readable when there are finished
+   jobs (see fs_init()), or -1 if the pool couldn't be started */
+int init_events(int servfd) {
+  listenfd = servfd;
+
+  /* without the filesystem pool, we'll just have to block */
+  if((fsfd = fs_init()) == -1)
+    log_text(err, "Unable to start filesystem threads: %s", strerror(errno));
+
+  return fsfd;
+}
+
+/* Closes a connection whose timeout has gone off */
+static void timed_out(timer *t) {
+  worker_stats.timeouts++;
+  close_connection(t->data);
+}
+
+/* Gives the connection seconds more seconds before it times out */
+void set_deadline(connection *c, int seconds) {
+  timer_set(&c->timeout, time(NULL) + seconds);
+}
+
+/* Creates a connection for the newly-accepted fd */
+connection *new_connection(int fd, const char *addr) {
+  connection *c = calloc(1, sizeof(connection));
+
+  c->fd = fd;
+  c->state = CONN_REQUEST;
+  strcpy(c->addr, addr);
+  c->timeout.fire = timed_out;
+  c->timeout.data = c;
+  set_deadline(c, HEADER_TIMEOUT);
+
+  c->next = conns;
+  if(conns) conns->prev = c;
+  conns = c;
+
+  return c;
+}
+
+/* Closes the connection and frees everything that belongs to it */
+void close_connection(connection *c) {
+  timer_cancel(&c->timeout);
+
+  /* io_uring still has operations that refer to the connection, so stop them
+     and leave the rest until they've finished */
+  if(c->ops) {
+    if(!c->closing) shutdown(c->fd, SHUT_RDWR);
+    c->closing = 1;
+    return;
+  }
+
+  if(engine == ENGINE_EPOLL) epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+
+  /* nobody wants this any more */
+  if(c->job) c->job->data = NULL;
+
+  if(c->r) free_request(c->r);
+  free_queue(&c->out);
+  free(c->in);
+  free(c->filebuf);
+
+  if(c->prev) c->prev->next = c->next;
+  else conns = c->next;
+  if(c->next) c->next->prev = c->prev;
+
+  free(c);
+}
+
+/* Accepts all of the pending connections on the listening socket */
+static void accept_connections(void) {
+  struct epoll_event ev;
+  char addr[INET6_ADDRSTRLEN];
+  connection *c;
+  int fd;
+
+  while((fd = accept_client(listenfd, addr, 1)) != -1) {
+    c = new_connection(fd, addr);
+    c->events = EPOLLIN;
+
+    memset(&ev, '\0', sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      log_text(err, "Unable to add connection to epoll: %s", strerror(errno));
+      close_connection(c);
+    }
+  }
+}
+
+/* Makes sure there's room for more input on the connection.
+   Returns 0 on success, or -1 if the connection should be closed */
+int grow_input(connection *c) {
+  if(c->in_len == c->in_size) {
+    /* process_input() should have refused a request this big already */
+    if(c->in_size >= max_request_line + max_header_size) {
+      log_text(err, "Request from %s is too large, closing connection.",
+               c->addr);
+      return -1;
+    }
+
+    c->in_size = c->in_size ? c->in_size * 2 : 4096;
+    c->in = realloc(c->in, c->in_size);
+  }
+
+  return 0;
+}
+
+/* Records that n more bytes of input have arrived on the connection */
+void got_input(connection *c, size_t n) {
+  /* the client has as long as it had for the first request to send the rest
+     of a new one, however slowly it sends it */
+  if(c->state == CONN_REQUEST && c->in_len == 0)
+    set_deadline(c, HEADER_TIMEOUT);
+
+  c->in_len += n;
+}
+
+/* Reads whatever input is available on the connection.
+   Returns 0 on success, or -1 if the connection should be closed */
+static int read_input(connection *c) {
+  ssize_t n;
+
+  if(grow_input(c) == -1) return -1;
+
+  n = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+
+  if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if(n <= 0) return -1;
+
+  got_input(c, n);
+
+  return 0;
+}
+
+/* Removes the first len bytes of input from the connection */
+static void consume_input(connection *c, size_t len) {
+  c->in_len -= len;
+  memmove(c->in, c->in + len, c->in_len);
+
+  /* idle connections shouldn't hold on to a buffer */
+  if(c->in_len == 0) {
+    free(c->in);
+    c->in = NULL;
+    c->in_size = 0;
+  }
+}
+
+/* Moves the connection for the given request in to a handler process of its
+   own, for responses that can only be sent by blocking (CGI scripts, gzip and
+   POST data).
+   Returns 1 in the event loop, which should then forget about the connection.
+   The handler process finishes the request and carries on with the rest of
+   the connection itself, so it never returns */
+int hand_off(request *r) {
+  connection *c = r->conn;
+  connection *other;
+  char addr[INET6_ADDRSTRLEN];
+  int fd = c->fd;
+  pid_t pid;
+  int n;
+
+  /* the handler can't share the connection with responses that we're still
+     sending, so it has to wait for them */
+  if(c->out.head || c->writing) {
+    c->state = CONN_WAITING;
+    return 1;
+  }
+
+  c->state = CONN_HANDOFF;
+
+  fflush(out);
+  fflush(err);
+
+  if((pid = fork()) == -1) {
+    log_text(err, "Unable to fork handler process for %s: %s", c->addr,
+             strerror(errno));
+    return 1;
+  }
+
+  if(pid) return 1;
+
+  /* don't keep anybody else's connection open */
+  for(other = conns; other; other = other->next)
+    if(other != c) close(other->fd);
+  close(epfd);
+  close(listenfd);
+  if(engine == ENGINE_URING) uring_close();
+
+  /* whatever we've read but not dealt with belongs to the handler */
+  set_nonblocking(fd, 0);
+  unread(fd, c->in, c->in_len);
+  strcpy(addr, c->addr);
+  r->conn = NULL;
+
+  if(r->meth == POST && r->status == 200 && record_post_data(r) == -1)
+    exit(0);
+
+  if(r->status == 200) send_file(r);
+  else send_errorpage(r);
+  log_request(r);
+
+  n = r->close_conn;
+  free_request(r);
+
+  if(n) close(fd);
+  else handle(fd, addr);
+
+  exit(0);
+}
+
+/* Keeps the filesystem pool reading the file at the front of the queue ahead
+   of what we're sending, so that we don't wait for the disk */
+static void read_ahead(connection *c) {
+  chunk *k = c->out.head;
+  int fildes;
+
+  if(fsfd == -1 || !k || k->fildes == -1) return;
+
+  /* stop at the end, and don't bother until we're half way through what has
+     been read already */
+  if(k->ahead >= k->offset + (off_t)(k->len - k->pos)) return;
+  if(k->ahead >= k->offset + READAHEAD_SIZE / 2) return;
+
+  if((fildes = fcntl(k->fildes, F_DUPFD_CLOEXEC, 0)) == -1) return;
+
+  k->ahead = MAX(k->ahead, k->offset);
+  fs_submit(fs_job(FS_READ, NULL, fildes, k->ahead, READAHEAD_SIZE, NULL));
+  k->ahead += READAHEAD_SIZE;
+}
+
+/* Gets ready for the next request once the response has all been sent.
+   Returns 0 on success, or -1 if the connection should be closed */
+int response_sent(connection *c) {
+  c->requests++;
+
+  if(c->r->close_conn || draining) return -1;
+
+  /* a pipelined request might have started arriving already */
+  set_deadline(c, c->in_len ? HEADER_TIMEOUT : c->r->keep_alive);
+
+  free_request(c->r);
+  c->r = NULL;
+  c->state = CONN_REQUEST;
+
+  return 0;
+}
+
+/* Waits for whatever the connection needs next: input while a request is
+   arriving, and room to send while there's output queued (see waiting()) */
+static void rewatch(connection *c) {
+  uint32_t events = 0;
+
+  if(engine != ENGINE_EPOLL) return;
+
+  if(c->state == CONN_REQUEST || c->state == CONN_HEADERS) events |= EPOLLIN;
+  if(c->out.head && c->state != CONN_FILESYSTEM) events |= EPOLLOUT;
+
+  watch(c, events);
+}
+
+/* Carries on once everything that was queued has been sent.
+   Returns 0 on success, or -1 if the connection should be closed */
+int output_sent(connection *c) {
+  c->queued = 0;
+
+  switch(c->state) {
+  case CONN_RESPONSE:
+    return response_sent(c);
+
+  case CONN_WAITING:
+    /* a handler process can have the connection now */
+    hand_off(c->r);
+    return -1;
+  }
+
+  rewatch(c);
+  return 0;
+}
+
+/* Sends as much of the response as possible, and gets ready for the next
+   request once it's all gone.
+   Returns 0 on success, or -1 if the connection should be closed */
+static int send_output(connection *c) {
+  int n;
+
+  /* io_uring sends it in the background, and calls output_sent() itself */
+  if(engine == ENGINE_URING) return uring_send(c);
+
+  read_ahead(c);
+
+  if((n = flush_queue(&c->out, c->fd)) == -1) return -1;
+
+  /* earlier pipelined responses don't put off the timeout for a request that's
+     still arriving */
+  if(c->state == CONN_RESPONSE || c->state == CONN_WAITING)
+    set_deadline(c, SEND_TIMEOUT);
+
+  /* wait until we can send some more */
+  if(n == 0) {
+    rewatch(c);
+    return 0;
+  }
+
+  return output_sent(c);
+}
+
+/* Sends any responses that are queued while the connection waits for the
+   client.
+   Returns 0 on success, or -1 if the connection should be closed */
+static int waiting(connection *c) {
+  /* the filesystem pool won't be long, and then the next response can go out
+     with the ones that are queued */
+  if(c->out.head && c->state != CONN_FILESYSTEM) return send_output(c);
+
+  rewatch(c);
+  return 0;
+}
+
+/* Answers the connection's request straight away with the given error status,
+   because it's too big to read, and closes the connection afterwards.
+   Returns 0 on success, or -1 if the connection should be closed */
+static int refuse(connection *c, int status) {
+  if(!c->r) {
+    c->r = bare_request(c->fd, c->addr, status);
+    c->r->conn = c;
+  }
+  c->r->status = status;
+  c->r->close_conn = 1;
+
+  c->in_len = 0;
+  c->state = CONN_RESPONSE;
+  send_errorpage(c->r);
+  log_request(c->r);
+
+  return send_output(c);
+}
+
+/* Deals with as much of the connection's input as possible.
+   Returns 0 on success, or -1 if the connection should be closed */
+int process_input(connection *c) {
+  request *r;
+  char *nl, *block;
+  size_t len;
+
+  while(1) {
+    switch(c->state) {
+    case CONN_REQUEST:
+      nl = c->in ? memchr(c->in, '\n', c->in_len) : NULL;
+      len = nl ? nl + 1 - c->in : c->in_len;
+
+      if(len > max_request_line) return refuse(c, 414);
+      if(!nl) return waiting(c);
+
+      /* get request info */
+      r = parse_request(c->fd, c->addr, c->in, len);
+      c->r = r;
+      r->conn = c;
+      consume_input(c, len);
+      worker_stats.requests++;
+
+      /* the filesystem pool can look for the file while the headers arrive,
+         unless it's in one of the caches */
+      if(r->status == 200 && r->file && !file_cached(r->file) &&
+         !shm_file_cached(r->file)) {
+        if(engine == ENGINE_URING) {
+          c->job = fs_job(FS_OPEN, r->file, -1, 0, 0, c);
+          uring_open(c->job);
+        } else if(fsfd != -1) {
+          c->job = fs_job(FS_OPEN, r->file, -1, 0, 0, c);
+          fs_submit(c->job);
+        }
+      }
+
+      c->state = CONN_HEADERS;
+      break;
+
+    case CONN_HEADERS:
+      r = c->r;
+      len = c->in ? headers_length(c->in, c->in_len) : 0;
+
+      if(len > max_header_size || (!len && c->in_len > max_header_size))
+        return refuse(c, 431);
+      if(!len) return waiting(c);
+
+      /* now record the headers */
+      block = arena_strndup(r->arena, c->in, len);
+      consume_input(c, len);
+      if(parse_headers(&r->headers, block, len, &(r->post_length)) == -1) {
+        /* there's no telling where a bad request ends */
+        r->status = 400;
+        r->close_conn = 1;
+      }
+
+      c->state = CONN_FILESYSTEM;
+      break;
+
+    case CONN_FILESYSTEM:
+      r = c->r;
+      if(c->job) return waiting(c);
+
+      if(r->status == 200) file_stuff(r);
+      fix_request(r);
+
+      /* sort out headers */
+      check_headers(r);
+      if(r->meth == POST && r->post_length == 0) r->status = 400;
+
+      /* and now handle the request */
+      c->state = CONN_RESPONSE;
+      if(r->meth == POST && r->status == 200) hand_off(r);
+      else {
+        /* nothing reads the body of a POST that isn't handed off, so it
+           mustn't be taken for the next request */
+        if(r->meth == POST || r->post_length) r->close_conn = 1;
+
+        if(r->status == 200) send_file(r);
+        else send_errorpage(r);
+      }
+
+      /* a handler process has taken the connection, or will once the
+         responses before this one have gone */
+      if(c->state == CONN_HANDOFF) return -1;
+      if(c->state == CONN_WAITING) return send_output(c);
+
+      log_request(r);
+
+      /* if the client has sent more requests already, answer them too before
+         sending anything, so that the responses all go out together */
+      if(c->in_len && !r->close_conn && !draining &&
+         ++c->queued < MAXPIPELINE) {
+        response_sent(c);
+        break;
+      }
+
+      if(send_output(c) == -1) return -1;
+      break;
+
+    case CONN_RESPONSE:
+    case CONN_WAITING:
+      /* wait until the response has been sent */
+      return 0;
+    }
+  }
+}
+
+/* Deals with a finished filesystem job */
+void finish_job(fsjob *job) {
+  connection *c;
+  request *r;
+
+  /* the connection may have been closed while the job was running */
+  if((c = job->data)) {
+    c->job = NULL;
+    r = c->r;
+
+    /* let file_stuff() and send_file() use what we found */
+    if((job->type == FS_OPEN || job->type == FS_COPIES) && job->result == 0) {
+      r->stat_file = arena_strdup(r->arena, job->path);
+      r->statbuf = job->statbuf;
+      r->fildes = job->fildes;
+      r->read_ahead = job->type == FS_OPEN && r->fildes != -1;
+      job->fildes = -1;
+      r->copies = job->copies;
+      no_copies(&job->copies);
+
+      /* a directory listing will want the directory's contents */
+      if(S_ISDIR(r->statbuf.st_mode) && fsfd != -1) {
+        c->job = fs_job(FS_SCANDIR, r->stat_file, -1, 0, 0, c);
+        fs_submit(c->job);
+      }
+    }
+
+    if(!c->job && process_input(c) == -1) close_connection(c);
+  }
+
+  fs_free(job);
+}
+
+/* Deals with the jobs that the filesystem pool has finished */
+void finish_jobs(void) {
+  fsjob *job, *next;
+
+  for(job = fs_done(); job; job = next) {
+    next = job->next;
+    finish_job(job);
+  }
+}
+
+/* Stops accepting connections, closes the ones that are waiting for another
+   request (one that was only just accepted is still owed a response), and
+   exits once the rest have finished (see upgrade.c) */
+void drain_connections(void) {
+  connection *c, *next;
+
+  if(listenfd != -1) {
+    if(engine == ENGINE_EPOLL) epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+    close(listenfd);
+    listenfd = -1;
+  }
+
+  for(c = conns; c; c = next) {
+    next = c->next;
+    if(c->state == CONN_REQUEST && c->in_len == 0 && !c->out.head &&
+       c->requests > 0)
+      close_connection(c);
+  }
+
+  if(!conns) exit(0);
+}
+
+/* Runs the event loop for connections accepted from servfd forever */
+void event_loop(int servfd) {
+  struct epoll_event ev, events[MAXEVENTS];
+  connection *c;
+  time_t now, last = 0;
+  int i, n, jobs;
+
+  listenfd = servfd;
+  set_nonblocking(listenfd, 1);
+
+  if((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    log_text(err, "Unable to create epoll instance: %s", strerror(errno));
+    exit(1);
+  }
+
+  /* only wake one of the workers for each new connection */
+  memset(&ev, '\0', sizeof(ev));
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+    log_text(err, "Unable to add listening socket to epoll: %s",
+             strerror(errno));
+    exit(1);
+  }
+
+  if(init_events(servfd) != -1) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &fsfd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fsfd, &ev) == -1) {
+      log_text(err, "Unable to add filesystem threads to epoll: %s",
+               strerror(errno));
+      exit(1);
+    }
+  }
+
+  while(1) {
+    n = epoll_wait(epfd, events, MAXEVENTS, 1000);
+    jobs = 0;
+
+    for(i = 0; i < n; i++) {
+      if(!(c = events[i].data.ptr)) {/* the listening socket */
+        accept_connections();
+        continue;
+      }
+
+      /* finishing jobs can close connections that have events further on,
+         so it waits until they've been dealt with */
+      if(events[i].data.ptr == &fsfd) {
+        jobs = 1;
+        continue;
+      }
+
+      /* the client has gone away */
+      if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(c);
+        continue;
+      }
+
+      if((events[i].events & EPOLLOUT && send_output(c) == -1) ||
+         (events[i].events & EPOLLIN && read_input(c) == -1)) {
+        close_connection(c);
+        continue;
+      }
+
+      if(process_input(c) == -1) close_connection(c);
+    }
+
+    if(jobs) finish_jobs();
+
+    /* check for timeouts once a second */
+    if((now = time(NULL)) != last) {
+      run_timers(now);
+      last = now;
+    }
+
+    if(stats_wanted) log_stats();
+    if(draining) drain_connections();
+  }
+}
+
+#else
+
+int hand_off(request *r) {
+  return 0;
+}
+
+void event_loop(int servfd) {
+  log_text(err, "The epoll engine is only available on Linux.");
+  exit(1);
+}
+
+#endif
@@ -0,0 +1,304 @@
+/* File cache for serve
+
+   A worker that keeps being asked for the same files keeps them open, along
+   with what stat() said about them and their content type and Last-Modified
+   date, so that it can serve them again without looking up their paths. Each
+   cached file has an inotify watch on it, and is dropped as soon as it is
+   changed, renamed, deleted or has its permissions changed. A file whose path
+   lands in the same slot as one that's already cached replaces it.
+
+   The copies of a file that were compressed in advance (see find_copies()) are
+   kept open with it, and so is knowing that there aren't any. The directory
+   that it's in is watched as well, and anything in there whose name starts
+   with the file's name being created, written, moved or deleted drops it.
+
+   Each process has a cache of its own; a child process starts with an empty
+   one, so that it doesn't take the inotify events that belong to its parent.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | \
+                      IN_DELETE_SELF)
+#define DIR_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+                    IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | \
+                    IN_ONLYDIR)
+
+typedef struct {
+  char *path;/* NULL if the slot is empty */
+  int fildes;
+  int wd;
+  int dir_wd;/* of the directory it's in */
+  struct stat statbuf;
+  compressed_copies copies;
+  char *content_type;
+  char last_modified[HTTP_DATE_SIZE];
+} cached_file;
+
+static cached_file cache[FILE_CACHE_SIZE];
+static int ifd = -1;
+
+/* Returns the slot that path belongs in */
+static cached_file *slot(const char *path) {
+  unsigned int hash = 2166136261u;
+
+  /* FNV-1a */
+  for(; *path; path++) hash = (hash ^ (unsigned char)*path) * 16777619u;
+
+  return &cache[hash % FILE_CACHE_SIZE];
+}
+
+/* Stops watching wd, unless a slot has a file (maybe through another path),
+   or the directory of one, that it's watching in it */
+static void unwatch(int wd) {
+  int i;
+
+  for(i = 0; i < FILE_CACHE_SIZE; i++)
+    if(cache[i].path && (cache[i].wd == wd || cache[i].dir_wd == wd)) return;
+
+  inotify_rm_watch(ifd, wd);
+}
+
+/* Empties the given slot, and stops watching its file and directory if
+   nothing else needs the watches. gone is a watch that has already gone, or
+   -1 */
+static void drop(cached_file *f, int gone) {
+  if(!f->path) return;
+
+  close(f->fildes);
+  close_copies(&f->copies);
+  free(f->path);
+  free(f->content_type);
+  f->path = NULL;
+
+  if(f->wd != gone) unwatch(f->wd);
+  if(f->dir_wd != gone) unwatch(f->dir_wd);
+}
+
+/* Returns 1 if the given event, from the watch on the directory that f is in,
+   could be about f or one of its compressed copies, or 0 if not */
+static int about(cached_file *f, struct inotify_event *ev) {
+  const char *name = strrchr(f->path, '/');
+
+  name = name ? name + 1 : f->path;
+
+  /* the directory itself has gone if there's no name */
+  return !ev->len || strncmp(ev->name, name, strlen(name)) == 0;
+}
+
+/* Drops whatever the inotify events that have arrived say has changed */
+static void check_events(void) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+  int i;
+
+  while((n = read(ifd, buf, sizeof(buf))) > 0) {
+    for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event*)p;
+
+      /* if events have been lost, anything could have changed */
+      for(i = 0; i < FILE_CACHE_SIZE; i++) {
+        if(!cache[i].path) continue;
+
+        /* a new compressed copy doesn't change the file, so the shared
+           cache wouldn't notice it otherwise */
+        if(cache[i].dir_wd == ev->wd && about(&cache[i], ev))
+          shm_drop_file(cache[i].path);
+        else if(cache[i].wd != ev->wd && ev->wd != -1)
+          continue;
+
+        drop(&cache[i], (ev->mask & IN_IGNORED) ? ev->wd : -1);
+      }
+    }
+  }
+}
+
+/* Empties the cache and closes the inotify descriptor; in a child process
+   this only closes the copies of the parent's descriptors */
+static void forget_cache(void) {
+  int i;
+
+  for(i = 0; i < FILE_CACHE_SIZE; i++) {
+    if(!cache[i].path) continue;
+
+    close(cache[i].fildes);
+    close_copies(&cache[i].copies);
+    free(cache[i].path);
+    free(cache[i].content_type);
+    cache[i].path = NULL;
+  }
+
+  if(ifd != -1) close(ifd);
+  ifd = -1;
+}
+
+/* Makes sure that child processes don't use their parent's cache */
+void init_file_cache(void) {
+  pthread_atfork(NULL, NULL, forget_cache);
+}
+
+/* Returns 1 if path is in the cache (and hasn't changed), or 0 if not */
+int file_cached(const char *path) {
+  cached_file *f = slot(path);
+
+  if(ifd == -1 || !f->path) return 0;
+
+  check_events();
+
+  return f->path && strcmp(f->path, path) == 0;
+}
+
+/* Returns what stat() said about path, if it's in the cache (and hasn't
+   changed), or NULL if not */
+const struct stat *cached_stat(const char *path) {
+  return file_cached(path) ? &slot(path)->statbuf : NULL;
+}
+
+/* Puts copies of the descriptors in from in to to.
+   Returns 0 on success, or -1 on error, with to empty */
+static int dup_copies(const compressed_copies *from, compressed_copies *to) {
+  int i;
+
+  no_copies(to);
+
+  for(i = 0; i < ENCODINGS; i++) {
+    if(from->fildes[i] == -1) continue;
+
+    if((to->fildes[i] = fcntl(from->fildes[i], F_DUPFD_CLOEXEC, 0)) == -1) {
+      close_copies(to);
+      return -1;
+    }
+    to->statbuf[i] = from->statbuf[i];
+  }
+  to->known = from->known;
+
+  return 0;
+}
+
+/* Fills in the file stuff for the given request (see file_stuff()) from the
+   cache, with a descriptor of its own in r->fildes, and of its compressed
+   copies in r->copies.
+   Returns 1 on success, or 0 if r->file isn't in the cache */
+int use_cached_file(request *r) {
+  cached_file *f = slot(r->file);
+  int fildes;
+
+  if(!file_cached(r->file)) return 0;
+
+  /* a descriptor of its own, so that it can be closed when it's been sent */
+  if((fildes = fcntl(f->fildes, F_DUPFD_CLOEXEC, 0)) == -1) return 0;
+  close_copies(&r->copies);
+  if(dup_copies(&f->copies, &r->copies) == -1) {
+    close(fildes);
+    return 0;
+  }
+
+  if(r->fildes != -1) close(r->fildes);
+  r->fildes = fildes;
+  r->read_ahead = 0;
+  r->stat_file = r->file;
+  r->statbuf = f->statbuf;
+  r->is_dir = 0;
+  r->content_type = arena_strdup(r->arena, f->content_type);
+  r->last_modified = arena_strdup(r->arena, f->last_modified);
+  r->last_modified_t = f->statbuf.st_mtime;
+  r->content_length = f->statbuf.st_size;
+
+  return 1;
+}
+
+/* Returns 1 if a and b are from stat()s of the same, unchanged file */
+static int same_file(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_size == b->st_size && a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/* Adds the file that file_stuff() has just dealt with for the given request
+   to the cache, if it's a regular file that it opened */
+void cache_file(request *r) {
+  struct stat path_stat, fd_stat;
+  compressed_copies copies;
+  char dir[PATH_MAX];
+  cached_file *f;
+  int fildes, wd, dir_wd;
+
+  if(!S_ISREG(r->statbuf.st_mode) || r->fildes == -1 || !r->stat_file ||
+     strcmp(r->stat_file, r->file) != 0 || !r->copies.known ||
+     dir_name(r->file, dir) == -1)
+    return;
+
+  if(ifd == -1 && (ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    log_text(err, "Unable to start file cache: %s", strerror(errno));
+    return;
+  }
+
+  /* make room first, since the watch could be the one that's already there
+     if it's the same file */
+  f = slot(r->file);
+  drop(f, -1);
+
+  /* the file could have changed, or been replaced, since it was looked at, so
+     it's only kept if what's being watched is still the same as what's open
+     and what was stat()ed */
+  if((wd = inotify_add_watch(ifd, r->file, WATCH_EVENTS)) == -1) return;
+  if((dir_wd = inotify_add_watch(ifd, dir, DIR_EVENTS)) == -1) {
+    unwatch(wd);
+    return;
+  }
+  if(stat(r->file, &path_stat) == -1 || fstat(r->fildes, &fd_stat) == -1 ||
+     !same_file(&path_stat, &r->statbuf) ||
+     !same_file(&fd_stat, &r->statbuf) ||
+     (fildes = fcntl(r->fildes, F_DUPFD_CLOEXEC, 0)) == -1) {
+    unwatch(wd);
+    unwatch(dir_wd);
+    return;
+  }
+  if(dup_copies(&r->copies, &copies) == -1) {
+    close(fildes);
+    unwatch(wd);
+    unwatch(dir_wd);
+    return;
+  }
+
+  f->path = strdup(r->file);
+  f->fildes = fildes;
+  f->wd = wd;
+  f->dir_wd = dir_wd;
+  f->statbuf = r->statbuf;
+  f->copies = copies;
+  f->content_type = strdup(r->content_type);
+  strcpy(f->last_modified, r->last_modified);
+}
+
+#else
+
+void init_file_cache(void) {
+}
+
+int file_cached(const char *path) {
+  return 0;
+}
+
+const struct stat *cached_stat(const char *path) {
+  return NULL;
+}
+
+int use_cached_file(request *r) {
+  return 0;
+}
+
+void cache_file(request *r) {
+}
+
+#endif
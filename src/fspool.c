@@ -0,0 +1,250 @@
+/* Filesystem thread pool for serve
+
+   An event loop can't afford to sit waiting for a slow disk, so it gives its
+   stat(), open(), scandir() and read-ahead work to a pool of threads instead,
+   and finds out that a job is done through an eventfd. Each thread has a queue
+   of its own, and steals from the back of the others' queues when it runs
+   out.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+typedef struct fsqueue_s {
+  pthread_mutex_t lock;
+  fsjob *head;
+  fsjob *tail;
+} fsqueue;
+
+static fsqueue queue[FS_THREADS];
+static unsigned int next_queue;
+
+/* threads sleep on this while there are no jobs anywhere */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending;/* jobs that have been submitted but not taken */
+
+/* finished jobs waiting for fs_done() */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static fsjob *done;
+
+static int efd = -1;
+
+/* Takes a job from the front of q, or from the back if steal is set.
+   Returns NULL if q is empty */
+static fsjob *take(fsqueue *q, int steal) {
+  fsjob *job;
+
+  pthread_mutex_lock(&q->lock);
+
+  if((job = steal ? q->tail : q->head)) {
+    if(job->prev) job->prev->next = job->next;
+    else q->head = job->next;
+    if(job->next) job->next->prev = job->prev;
+    else q->tail = job->prev;
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  if(job) {
+    pthread_mutex_lock(&idle_lock);
+    pending--;
+    pthread_mutex_unlock(&idle_lock);
+  }
+
+  return job;
+}
+
+/* Warms the kernel's caches for a directory listing by reading the directory
+   and stat()ing everything in it */
+static int read_dir(const char *path) {
+  struct dirent **namelist;
+  struct stat statbuf;
+  char *file;
+  int i, n;
+
+  if((n = scandir(path, &namelist, nonhidden, NULL)) < 0) return -1;
+
+  for(i = 0; i < n; i++) {
+    file = malloc(strlen(path) + strlen(namelist[i]->d_name) + 2);
+    sprintf(file, "%s/%s", path, namelist[i]->d_name);
+    stat(file, &statbuf);
+    free(file);
+    free(namelist[i]);
+  }
+  free(namelist);
+
+  return 0;
+}
+
+/* Does the blocking part of the job */
+static void run_job(fsjob *job) {
+  switch(job->type) {
+  case FS_OPEN:
+    if((job->result = stat(job->path, &job->statbuf)) == -1) break;
+    if(!S_ISREG(job->statbuf.st_mode)) break;
+
+    /* bring the start of the file in to memory while we're here, so that the
+       event loop doesn't wait for it when sending */
+    if((job->fildes = open(job->path, O_RDONLY | O_CLOEXEC)) == -1) break;
+    readahead(job->fildes, 0, MIN(job->statbuf.st_size, READAHEAD_SIZE));
+
+    find_copies(job->path, &job->statbuf, &job->copies);
+    break;
+
+  case FS_COPIES:
+    find_copies(job->path, &job->statbuf, &job->copies);
+    break;
+
+  case FS_SCANDIR:
+    job->result = read_dir(job->path);
+    break;
+
+  case FS_READ:
+    job->result = readahead(job->fildes, job->offset, job->len);
+    close(job->fildes);
+    job->fildes = -1;
+    break;
+  }
+}
+
+static void *fs_thread(void *arg) {
+  int me = (long)arg;
+  fsjob *job;
+  uint64_t one = 1;
+  int i, wake;
+
+  while(1) {
+    /* our own work first, then anyone else's */
+    job = take(&queue[me], 0);
+    for(i = 1; !job && i < FS_THREADS; i++)
+      job = take(&queue[(me + i) % FS_THREADS], 1);
+
+    if(!job) {
+      pthread_mutex_lock(&idle_lock);
+      while(pending == 0) pthread_cond_wait(&idle_cond, &idle_lock);
+      pthread_mutex_unlock(&idle_lock);
+      continue;
+    }
+
+    run_job(job);
+
+    pthread_mutex_lock(&done_lock);
+    wake = !done;
+    job->next = done;
+    done = job;
+    pthread_mutex_unlock(&done_lock);
+
+    /* fs_done() takes the whole list, so it only needs waking for the first */
+    if(wake) write(efd, &one, sizeof(one));
+  }
+
+  return NULL;
+}
+
+/* Starts the pool's threads.
+   Returns a file descriptor that becomes readable when there are finished
+   jobs, or -1 on error */
+int fs_init(void) {
+  pthread_t thread;
+  long i;
+
+  if((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) return -1;
+
+  for(i = 0; i < FS_THREADS; i++)
+    pthread_mutex_init(&queue[i].lock, NULL);
+
+  for(i = 0; i < FS_THREADS; i++) {
+    if(pthread_create(&thread, NULL, fs_thread, (void*)i) != 0) return -1;
+    pthread_detach(thread);
+  }
+
+  return efd;
+}
+
+/* Creates a new job of the given type for path (which is copied), or for
+   len bytes of fildes from offset. data is whatever the caller wants back
+   with the finished job */
+fsjob *fs_job(int type, const char *path, int fildes, off_t offset,
+              size_t len, void *data) {
+  fsjob *job = calloc(1, sizeof(fsjob));
+
+  job->type = type;
+  job->path = path ? strdup(path) : NULL;
+  job->fildes = fildes;
+  job->offset = offset;
+  job->len = len;
+  job->data = data;
+  no_copies(&job->copies);
+
+  return job;
+}
+
+/* Gives the job to the next thread's queue */
+void fs_submit(fsjob *job) {
+  fsqueue *q = &queue[next_queue++ % FS_THREADS];
+
+  pthread_mutex_lock(&q->lock);
+  job->next = NULL;
+  job->prev = q->tail;
+  if(q->tail) q->tail->next = job;
+  else q->head = job;
+  q->tail = job;
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_mutex_lock(&idle_lock);
+  pending++;
+  pthread_cond_signal(&idle_cond);
+  pthread_mutex_unlock(&idle_lock);
+}
+
+/* Returns a list (linked by next) of all of the jobs that have finished since
+   the last call, which the caller should free with fs_free() */
+fsjob *fs_done(void) {
+  uint64_t n;
+  fsjob *list;
+
+  read(efd, &n, sizeof(n));
+
+  pthread_mutex_lock(&done_lock);
+  list = done;
+  done = NULL;
+  pthread_mutex_unlock(&done_lock);
+
+  return list;
+}
+
+#else
+
+int fs_init(void) {
+  return -1;
+}
+
+fsjob *fs_job(int type, const char *path, int fildes, off_t offset,
+              size_t len, void *data) {
+  return NULL;
+}
+
+void fs_submit(fsjob *job) {
+}
+
+fsjob *fs_done(void) {
+  return NULL;
+}
+
+#endif
+
+/* Frees the job, closing any file that nobody took */
+void fs_free(fsjob *job) {
+  if(job->fildes != -1) close(job->fildes);
+  close_copies(&job->copies);
+  free(job->path);
+  free(job);
+}
@@ -7,32 +7,25 @@
 char *size[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB" };
 int num_sizes = 9;
 
-/* adds a formatted string to the given string, and reallocates the given string
-   such that it is big enough */
-void add_text(char **page, size_t *pagelen, char *fmt, ...) {
+/* adds a formatted string to the given string, which is made big enough for it
+   in the arena a */
+void add_text(arena *a, char **page, size_t *pagelen, char *fmt, ...) {
   va_list args;
-  char *line;
   int len;
-  size_t oldlen = *pagelen;
-
-  line = malloc(1024);
 
+  /* find out how long it's going to be */
   va_start(args, fmt);
+  len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
 
-  /* let vsnprintf convert to a string */
-  if((len = vsnprintf(line, 1024, fmt, args)) > 1024) {
-    line = realloc(line, len + 1);
-    vsnprintf(line, len + 1, fmt, args);
-  }
-  *pagelen += len;
-	
-  /* and now re-allocate the main string and add the new string */
-  *page = realloc(*page, *pagelen + 1);
-  strcpy(*page + oldlen, line);
+  /* the page is usually the last thing in the arena, so it just grows */
+  *page = arena_grow(a, *page, *page ? *pagelen + 1 : 0, *pagelen + len + 1);
 
-  free(line);
-		
+  va_start(args, fmt);
+  vsprintf(*page + *pagelen, fmt, args);
   va_end(args);
+
+  *pagelen += len;
 }
 
 /* Decides whether to send a dir listing or the index page and acts
@@ -44,7 +37,8 @@ void send_dir(request *r) {
   int i;
 
   /* try to get the index page */
-  file = malloc(strlen(r->file) + /* strlen("/index.") */ 7 + longest_ext + 1);
+  file = arena_alloc(r->arena, strlen(r->file) + /* strlen("/index.") */ 7 +
+                     longest_ext + 1);
   sprintf(file, "%s/index.%n", r->file, &i);
   ptr = file + i;/* ptr is the place where file extension should go */
   i = 0;
@@ -56,7 +50,6 @@ void send_dir(request *r) {
     if(fildes != -1) {/* index page can be opened for reading, send it */
       close(fildes);
       /* sort out our request structure */
-      free(r->file);
       r->file = file;
       file_stuff(r);
       send_file(r);
@@ -65,7 +58,6 @@ void send_dir(request *r) {
   }
 
   /* index page doesn't exist or can't be read, send dir list */
-  free(file);
   send_dirlist(r);
 }
 
@@ -122,7 +114,6 @@ void send_dirlist(request *r) {
   int i;
   char *page = NULL;
   size_t len = 0;
-  char *reqfile;
   int numfiles = 0;
   struct dirent **file = NULL;
   char *fname = NULL;
@@ -130,14 +121,9 @@ void send_dirlist(request *r) {
 
   /* redirect if the URL contains GET parameters */
   if((p = strchr(r->reqfile, '?'))) {
-    reqfile = strdup(r->reqfile);
-    p = strchr(reqfile, '?');
-    *p = '\0';
-    free(r->location);
-    r->location = strdup(reqfile);
+    r->location = arena_strndup(r->arena, r->reqfile, p - r->reqfile);
     r->status = 301;
     send_errorpage(r);
-    free(reqfile);
     return;
   }
  
@@ -149,11 +135,12 @@ void send_dirlist(request *r) {
   }
 
   /* and generate the page */
-  add_text(&page, &len,
+  add_text(r->arena, &page, &len,
            "<html><head><title>Index of %s</title></head></html>\n",
            r->reqfile);
-  add_text(&page, &len, "<body><h1>Index of %s</h1></body>\n", r->reqfile);
-  add_text(&page, &len, "<table>\n");
+  add_text(r->arena, &page, &len, "<body><h1>Index of %s</h1></body>\n",
+           r->reqfile);
+  add_text(r->arena, &page, &len, "<table>\n");
 
   /* generate the page */
   for(i = 0; i < numfiles; i++) {
@@ -166,40 +153,36 @@ void send_dirlist(request *r) {
     sprintf(fname, "%s/%s", r->file, file[i]->d_name);
 
     /* add the image */
-    add_text(&page, &len,
+    add_text(r->arena, &page, &len,
              "<tr><td><img src=\"/" IMAGE_PATH "%s\" alt=\"%s\"></td> ",
              (file[i]->d_type == DT_DIR) ? "folder.png" : type_image(fname),
              (file[i]->d_type == DT_DIR) ? "DIR" : general_type(fname));
 
     /* the file name; append a / if it's a dir so we don't cause a redirect */
-    add_text(&page, &len, "<td><a href=\"%s%s%s\">%s</a></td> ",
+    add_text(r->arena, &page, &len, "<td><a href=\"%s%s%s\">%s</a></td> ",
              r->reqfile, file[i]->d_name,
              (file[i]->d_type == DT_DIR) ? "/" : "", file[i]->d_name);
 
     /* and the size */
-    add_text(&page, &len, "<td align=\"right\">%s</td></tr>\n",
+    add_text(r->arena, &page, &len, "<td align=\"right\">%s</td></tr>\n",
              file_size(fname));
     free(file[i]);
   }
 
   /* terminate the page */
-  add_text(&page, &len, "</table></body></html>\n");
+  add_text(r->arena, &page, &len, "</table></body></html>\n");
 
   free(fname);
 
   /* send the page */
-  free(r->content_type);
-  r->content_type = strdup("text/html");
+  r->content_type = "text/html";
   
   r->encoding = IDENTITY;
   r->content_length = len;
 
-  send_headers(r);
-  send_str(r->fd, "\r\n");
-  if(r->meth != HEAD) send(r->fd, page, len, 0);
+  send_headers(r, NULL, NULL, page, r->meth != HEAD ? len : 0, 0);
 
   free(file);
-  free(page);
 }
 
 /* Generates and sends an error document */
@@ -214,55 +197,40 @@ void send_errorpage(request *r) {
   if((fildes = open(file, O_RDONLY)) != -1) {/* file exists and is readable */
     close(fildes);
     /* set up the request structure */
-    free(r->file);
-    r->file = strdup(file);
+    r->file = arena_strdup(r->arena, file);
     file_stuff(r);
     send_file(r);
     return;
   }
 
   /* Generate page */
-  add_text(&page, &len, "<html><head><title>%d %s</title></head>\n", r->status,
+  add_text(r->arena, &page, &len, "<html><head><title>%d %s</title></head>\n", r->status,
            status_reason[r->status]);
-  add_text(&page, &len, "<body><h1>%d %s</h1>\n", r->status,
+  add_text(r->arena, &page, &len, "<body><h1>%d %s</h1>\n", r->status,
            status_reason[r->status]);
 
   if(page_text[r->status]) 
-    add_text(&page, &len, page_text[r->status]);
+    add_text(r->arena, &page, &len, page_text[r->status]);
   else
-    add_text(&page, &len, "See "
+    add_text(r->arena, &page, &len, "See "
              "<a href=\"http://www.w3.org/Protocols/rfc2616/rfc2616-sec10.html\">"
              "this</a> for more information.");
 
-  add_text(&page, &len, "\n</body></html>\n");
+  add_text(r->arena, &page, &len, "\n</body></html>\n");
 
   /* And now send the page */
-  free(r->content_type);
-  r->content_type = strdup("text/html");
+  r->content_type = "text/html";
 
   r->encoding = IDENTITY;
   r->content_length = len;
 
-  send_headers(r);
-  send_str(r->fd, "\r\n");
-  if(r->meth != HEAD) send(r->fd, page, len, 0);
-
-  free(page);
+  send_headers(r, NULL, NULL, page, r->meth != HEAD ? len : 0, 0);
 }
 
 /* sends a HTTP/1.0 500 page to fd, without requiring a request structure */
 void send_emergency_500(int fd, const char *file, int line,
                         const char *reason) {
-  request *r;
-
-  r = calloc(1, sizeof(request));
-  
-  /* fill in an absolutely minimal request structure */
-  r->fd = fd;
-  r->http = strdup("HTTP/1.0");
-  r->status = 500;
-  r->meth = GET;
-  r->close_conn = 1;
+  request *r = bare_request(fd, NULL, 500);
 
   /* and send the error */
   send_errorpage(r);
@@ -10,82 +10,84 @@ char *method[METHODS] = {
   "GET", "HEAD", "POST", "OPTIONS", "PUT", "DELETE", "TRACE", "CONNECT"
 };
 
-/* Handles the connection from the given file descriptor */
+/* Sets how long reads from fd may wait before giving up on the client */
+void set_timeout(int fd, int seconds) {
+  struct timeval tv;
+
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* Sends an error page with the given status for a request that couldn't be
+   read properly */
+static void refuse(int fd, const char *addr, int status) {
+  request *r = bare_request(fd, addr, status);
+
+  send_errorpage(r);
+  log_request(r);
+  free_request(r);
+}
+
+/* Handles the connection from the given file descriptor, and returns once the
+   connection has been closed */
 void handle(int fd, const char *addr) {
-  int n;
   request *r;
-  char *req;
+  char *line;
+  size_t len;
+
+  /* don't wait forever for a client that never sends a request */
+  set_timeout(fd, MAXKEEPALIVE);
 
   /* in while loop because of persistent connections */
   while(1) {
-    /* read the first line from the client */
-    req = stripendl(nextline(fd));
-    if(!req) {/* client disappeared */
-      close(fd);
-      exit(0);
+    /* read the first line from the client; nothing is lost if we're told to
+       exit while waiting for it */
+    idle = 1;
+    line = read_line(fd, max_request_line, &len);
+    idle = 0;
+    if(!line) {/* client disappeared or timed out, or the line is too long */
+      if(errno == E2BIG) refuse(fd, addr, 414);
+      break;
     }
+    worker_stats.requests++;
 
     /* get request info */
-    r = request_info(fd, addr, req);
+    r = request_info(fd, addr, line, len);
     fix_request(r);
 
     /* now record the headers */
-    while((n = next_header(fd, NULL, &(r->header_list), r->num_headers++,
-                           &(r->post_length))) > 0);
-    if(n == -1) {
-      r->num_headers--;
-      r->status = 400;
-    }	else if(n == -2) {
-      log_text(err, "Premature disconnection by %s during header collection.",
-               addr);
-      free_request(r);
-      exit(0);
-    } else if(n == -3) r->num_headers = 0;
-
-    /* Sort out headers */
-    /* TODO: "Accept:" header */
-    /* TODO: "Range:" header
-       http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html#sec14.35 */
-    /* TODO: http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html */
-    /* TODO: Put this stuff in the loop that the headers are recorded in so
-       that we don't have to go over the whole array twice */
-    for(n = 0; n < r->num_headers; n++) {
-      if(strcasecmp(r->header_list[n].name, "Host") == 0) {
-        r->host = strdup(r->header_list[n].value);
-      } else if(strcasecmp(r->header_list[n].name, "Connection") == 0) {
-        if(strcasecmp(r->header_list[n].value, "close") == 0) {
-          r->close_conn = 1;
-        }
-      } else if(strcasecmp(r->header_list[n].name, "Keep-alive") == 0) {
-        r->keep_alive = MIN(atoi(r->header_list[n].value), MAXKEEPALIVE);
-      } else if(strcasecmp(r->header_list[n].name, "If-modified-since")
-                == 0) {
-        r->if_modified_since = get_date(r->header_list[n].value);
-      } else if(strcasecmp(r->header_list[n].name, "Accept-encoding") == 0) {
-        r->encoding = get_encoding(r->header_list[n].value);
-      } else if(strcasecmp(r->header_list[n].name, "Content-encoding")
-                == 0) {
-        if(strcasecmp(r->header_list[n].value, "identity") != 0)
-          r->status = 415;
-      } else if(strcasecmp(r->header_list[n].name, "User-agent") == 0) {
-        r->user_agent = strdup(r->header_list[n].value);
+    if(!(line = read_headers(fd, max_header_size, &len))) {
+      if(errno == E2BIG) {
+        r->status = 431;
+        r->close_conn = 1;
+        send_errorpage(r);
+        log_request(r);
+      } else {
+        log_text(err, "Premature disconnection by %s during header "
+                 "collection.", addr);
       }
+      free_request(r);
+      break;
+    } else if(parse_headers(&r->headers, arena_strndup(r->arena, line, len),
+                            len, &(r->post_length)) == -1) {
+      /* there's no telling where a bad request ends */
+      r->status = 400;
+      r->close_conn = 1;
     }
 
-    if(!r->host) {/* HTTP/1.1 requires a host header */
-      if(strcmp(r->http, "HTTP/1.0") == 0) r->host = strdup(server_name);
-      else r->status = 400;
-    }
-    
-    /* see about authenticating the client */
-    if(!authenticated(r)) r->status = 401;
+    /* sort out headers */
+    check_headers(r);
 
     /* record post data */
     if(r->meth == POST) {
-      if(r->post_length > 0)
-        record_post_data(r);
-      else
+      if(r->post_length == 0)
         r->status = 400;
+      else if(record_post_data(r) == -1) {
+        free_request(r);
+        break;
+      }
     }
 
     /* and now handle the request */
@@ -97,57 +99,93 @@ void handle(int fd, const char *addr) {
       log_request(r);
     }
 
-    if(r->close_conn) break;
+    if(r->close_conn || draining) {
+      free_request(r);
+      break;
+    }
 
-    /* kill the process if there isn't another request soon */
-    alarm(r->keep_alive);
+    /* give up on the connection if there isn't another request soon */
+    set_timeout(fd, r->keep_alive);
 
     free_request(r);
   }
 
-  /* to prevent valgrind from complaining, we could free the mime types here and
-     also close libmagic's cookie;
-     we won't do this though, as that would cause copy-on-write of the mime
-     types, which is a waste of time seeing as we're leaving now anyway */
-
-  free_request(r);
-  exit(0);
+  /* anything else the client sent goes with the connection */
+  forget_input();
+  close(fd);
 }
 
-/* records post data for the given request, terminates the process if there is
-   an error collecting the data */
-void record_post_data(request *r) {
-  int bytes;
-  int bytesdone = 0;
+/* Sorts out the headers that the client sent for the given request, filling in
+   the request structure and setting the status if the headers aren't
+   acceptable */
+void check_headers(request *r) {
+  char **known = r->headers.known;
+
+  /* TODO: "Accept:" header */
+  /* TODO: http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html */
+  r->host = known[HEADER_HOST];
+  if(known[HEADER_CONNECTION] && strcasecmp(known[HEADER_CONNECTION],
+                                            "close") == 0)
+    r->close_conn = 1;
+  if(known[HEADER_KEEP_ALIVE])
+    r->keep_alive = MIN(atoi(known[HEADER_KEEP_ALIVE]), MAXKEEPALIVE);
+  if(known[HEADER_IF_MODIFIED_SINCE])
+    r->if_modified_since = get_date(known[HEADER_IF_MODIFIED_SINCE]);
+  r->if_none_match = known[HEADER_IF_NONE_MATCH];
+  if(known[HEADER_ACCEPT_ENCODING]) {
+    r->accept_encodings = get_encodings(known[HEADER_ACCEPT_ENCODING]);
+    r->encoding = get_encoding(r->accept_encodings);
+  }
+  if(known[HEADER_CONTENT_ENCODING] &&
+     strcasecmp(known[HEADER_CONTENT_ENCODING], "identity") != 0)
+    r->status = 415;
+  if(r->meth == POST && r->post_length > MAXPOSTLENGTH) {
+    /* the data isn't read, so the connection can't be used again */
+    r->status = 413;
+    r->close_conn = 1;
+  }
+  r->user_agent = known[HEADER_USER_AGENT];
+  if(r->meth == GET) {/* ranges of anything else are ignored */
+    r->range = known[HEADER_RANGE];
+    r->if_range = known[HEADER_IF_RANGE];
+  }
 
-  if(r->meth != POST) return;
+  if(!r->host) {/* HTTP/1.1 requires a host header */
+    if(strcmp(r->http, "HTTP/1.0") == 0) r->host = server_name;
+    else r->status = 400;
+  }
+  
+  /* see about authenticating the client */
+  if(!authenticated(r)) r->status = 401;
+}
 
-  r->post_data = malloc(r->post_length);
+/* records post data for the given request; returns 0 on success, or -1 if the
+   client disconnected before sending all of the data */
+int record_post_data(request *r) {
+  ssize_t bytes;
+  size_t bytesdone = 0;
+
+  /* check_headers() has already refused it if it's too big */
+  if(r->meth != POST || r->post_length > MAXPOSTLENGTH) return 0;
+
+  if(!(r->post_data = arena_alloc(r->arena, r->post_length))) {
+    log_text(err, "Unable to allocate %lu bytes for POST data from %s.",
+             (unsigned long)r->post_length, r->client);
+    r->status = 500;
+    r->close_conn = 1;
+    return 0;
+  }
 
   while(bytesdone < r->post_length) {
-    bytes =	recv(r->fd, r->post_data + bytesdone, r->post_length - bytesdone,
-                     0);
+    bytes = read_data(r->fd, r->post_data + bytesdone,
+                      r->post_length - bytesdone);
     if(bytes <= 0) {/* client has left */
       log_text(err, "Premature disconnection by %s during POST data "
                "collection.", r->client);
-      free_request(r);
-      exit(1);
+      return -1;
     }
     bytesdone += bytes;
   }
-}
-
-/* returns a time_t that is the date described by str */
-time_t get_date(const char *str) {
-  struct tm tm_time;
-
-  /* appease valgrind */
-  memset(&tm_time, '\0', sizeof(struct tm));
-
-  if(strptime(str, "%a, %d %b %Y %T %Z", &tm_time) == NULL)
-    if(strptime(str, "%A, %d-%b-%y %T %Z", &tm_time) == NULL)
-      if(strptime(str, "%a %b %T %Y", &tm_time) == NULL)
-        return 0;
 
-  return mktime(&tm_time);
+  return 0;
 }
@@ -6,101 +6,174 @@
 
 #include "serve.h"
 
-/* adds the given header and value to the list;
-   These will be free'd when free_headers() is called, so make sure that's
-   safe */
-void add_header(header **list, int num, char *name, char *value) {
-  *list = realloc(*list, (num + 1) * 2 * sizeof(char*));
-
-  (*list)[num].name = name;
-  (*list)[num].value = value;
+char *header_name[HEADERS] = {
+  "Host", "Connection", "Keep-Alive", "If-Modified-Since", "Accept-Encoding",
+  "Content-Encoding", "User-Agent", "Content-Length", "Content-Type",
+  "Authorization", "Date", "Last-Modified", "Status", "Location", "Server",
+  "Range", "If-Range", "If-None-Match"
+};
+
+/* The known headers by hash (see header_hash()). The multipliers were picked
+   so that no two of the names above share a slot; if you add one, check that
+   it gets a slot of its own, or find new multipliers */
+#define HASH_SLOTS 32
+
+static const signed char header_slot[HASH_SLOTS] = {
+  HEADER_HOST, HEADER_KEEP_ALIVE, HEADER_SERVER, HEADER_STATUS,
+  HEADER_USER_AGENT, HEADER_UNKNOWN, HEADER_UNKNOWN, HEADER_UNKNOWN,
+  HEADER_UNKNOWN, HEADER_DATE, HEADER_UNKNOWN, HEADER_AUTHORIZATION,
+  HEADER_RANGE, HEADER_UNKNOWN, HEADER_IF_MODIFIED_SINCE, HEADER_IF_RANGE,
+  HEADER_CONTENT_LENGTH, HEADER_UNKNOWN, HEADER_ACCEPT_ENCODING,
+  HEADER_UNKNOWN, HEADER_UNKNOWN, HEADER_IF_NONE_MATCH, HEADER_UNKNOWN,
+  HEADER_LAST_MODIFIED, HEADER_UNKNOWN, HEADER_UNKNOWN, HEADER_CONNECTION,
+  HEADER_UNKNOWN, HEADER_UNKNOWN, HEADER_CONTENT_ENCODING, HEADER_LOCATION,
+  HEADER_CONTENT_TYPE
+};
+
+/* Hashes the len bytes of the header name at name, ignoring case */
+static int header_hash(const char *name, size_t len) {
+  unsigned char first = name[0] | 0x20;
+  unsigned char last = name[len - 1] | 0x20;
+
+  return (len * 7 + first * 2 + last) & (HASH_SLOTS - 1);
 }
 
-/* frees the given header list, including all the headers and values */
-void free_headers(header *list, int num) {
-  int i;
+/* Returns the number of the header whose name is the len bytes at name (see
+   serve.h), or HEADER_UNKNOWN if it isn't one that we know about */
+int header_id(const char *name, size_t len) {
+  int id;
 
-  if(!list) return;
+  if(!len) return HEADER_UNKNOWN;
 
-  for(i = 0; i < num; i++) {
-    free(list[i].name);
-    free(list[i].value);
-  }
+  /* only one name can be in the slot, so one comparison settles it */
+  id = header_slot[header_hash(name, len)];
+  if(id == HEADER_UNKNOWN || strncasecmp(name, header_name[id], len) != 0 ||
+     header_name[id][len])
+    return HEADER_UNKNOWN;
 
-  free(list);
+  return id;
 }
 
-/* gets the next header from the given file descriptor and adds it to the given
-   list; returns > 0 if there are more headers, = 0 if there are no more
-   headers, -1 if there was a bad request, -2 if the connection was dropped
-   prematurely, and -3 if this is the first line to be read and it is blank
-   If the return value is -1 and the parameter lin is non-NULL , then a pointer
-   to the last line to be read (with endline stripped) is put in lin, which you
-   must free yourself */
-int next_header(int fd, char **lin, header **list, int num, size_t *length) {
-  static char *line;
-  char *header = NULL;
-  char *value = NULL;
-  char *ptr;
-  size_t size = 0;
-  size_t len = 0;
-
-  /* sort out the last line that was read */
-  if(line) {
-    if(*line == '\0') {
-      free(line);
-      line = NULL;
-      return 0;
-    }
-  } else {
-    if((line = stripendl(nextline(fd))) == NULL) return -2;
+/* Adds a header with the given name and value, which must be in h's block, to
+   the end of h's list, and returns it. If it's a header that we know about,
+   its value goes in h's known table as well */
+header *add_header(headers *h, char *name, size_t name_len, char *value,
+                   size_t value_len) {
+  header *hdr;
+
+  if(!h->list) {
+    h->list = h->inline_list;
+    h->size = INLINE_HEADERS;
   }
 
-  if(*line == '\0') {
-    free(line);
-    line = NULL;
-    return -3;
+  /* only requests with an unusual number of headers need the heap */
+  if(h->num == h->size) {
+    h->size *= 2;
+    if(h->list == h->inline_list) {
+      h->list = malloc(h->size * sizeof(header));
+      memcpy(h->list, h->inline_list, h->num * sizeof(header));
+    } else {
+      h->list = realloc(h->list, h->size * sizeof(header));
+    }
   }
 
-  /* find the end of the header name */
-  ptr = strchr(line, ':');
-  if(!ptr) {
-    if(lin) *lin = line;
-    else free(line);
-    line = NULL;
-    return -1;
+  hdr = &h->list[h->num++];
+  hdr->name = name;
+  hdr->name_len = name_len;
+  hdr->value = value;
+  hdr->value_len = value_len;
+
+  /* the last of a known header is the one that counts */
+  if((hdr->id = header_id(name, name_len)) != HEADER_UNKNOWN)
+    h->known[hdr->id] = value;
+
+  return hdr;
+}
+
+/* frees the given headers' list if it's on the heap */
+void free_headers(headers *h) {
+  if(h->list != h->inline_list) free(h->list);
+
+  h->list = NULL;
+  h->num = h->size = 0;
+  memset(h->known, '\0', sizeof(h->known));
+}
+
+/* Returns the length of the block of header lines at the start of buf (len
+   bytes long), including the blank line that ends it, or 0 if buf doesn't
+   contain the whole block yet */
+size_t headers_length(const char *buf, size_t len) {
+  const char *p = buf;
+  const char *end = buf + len;
+
+  /* each line ends at a \n, and the block ends at the first blank one */
+  while(p < end) {
+    if(*p == '\n') return p + 1 - buf;
+    if(*p == '\r' && p + 1 < end && p[1] == '\n') return p + 2 - buf;
+
+    if(!(p = memchr(p, '\n', end - p))) return 0;
+    p++;
   }
 
-  /* copy the header name */
-  header = strdup2(line, ptr - line);
-
-  ptr++;/* skip the colon */
-  while(iswhite(*ptr)) ptr++;/* skip whitespace */
-
-  /* go through each line that contains the contents for this header */
-  do {
-    /* add on the value */
-    len = strlen(ptr);
-    value = realloc(value, size + len + 1);
-    strcpy(value + size, ptr);
-    size += len;
-    /* get the next line */
-    free(line);
-    if((line = stripendl(nextline(fd))) == NULL) return -2;
-    for(ptr = line; iswhite(*(ptr+1)); ptr++);/* skip whitespace, except one */
-  } while(!strchr(line, ':') && *line);
-
-  /* now add the header to the list */
-  add_header(list, num, header, value);
-
-  /* set *length */
-  if(length && (strcasecmp(header, "Content-Length") == 0))
-    *length = strtoull(value, NULL, 10);
-
-  if(*line) return 1;/* more headers */
-  else {/* end of headers */
-    free(line);
-    line = NULL;
-    return 0;
+  return 0;
+}
+
+/* parses the block of header lines in block (as measured by headers_length(),
+   so it must end with a blank line) and adds them to h, so block has to last
+   as long as h does. The headers are left where they are in the block, with a
+   NUL put after each name and value, and continuation lines moved up to join
+   the value they belong to.
+   *length is set from the Content-Length header, if length is non-NULL.
+   Returns 0 on success, or -1 if there was a bad header (in which case the
+   headers before it are still in h) */
+int parse_headers(headers *h, char *block, size_t len, size_t *length) {
+  char *line, *nl, *ptr, *colon;
+  char *end = block + len;
+  header *last = NULL;
+  size_t n;
+
+  for(line = block; line < end; line = nl + 1) {
+    /* find the colon and the end of the line in one go */
+    colon = (char*)scan(line, end, ':', ':');
+    if(colon < end && *colon == ':') {
+      nl = (char*)scan(colon + 1, end, '\0', '\0');
+    } else {
+      nl = colon;
+      colon = NULL;
+    }
+
+    /* split off this line; anything but \n or \r\n where it stopped is a byte
+       that can't be in a header */
+    n = nl - line;
+    if(nl + 1 < end && nl[0] == '\r' && nl[1] == '\n') *nl++ = '\0';
+    if(nl == end || *nl != '\n') return -1;
+    *nl = '\0';
+
+    /* lines without a colon are a continuation of the last value */
+    if(last && !colon && n) {
+      /* skip whitespace, except one */
+      for(ptr = line; iswhite(*(ptr+1)); ptr++);
+      n = line + n - ptr;
+      memmove(last->value + last->value_len, ptr, n + 1);
+      last->value_len += n;
+      continue;
+    }
+
+    /* a blank line ends the headers */
+    last = NULL;
+    if(!n) break;
+
+    if(!colon) return -1;
+
+    /* split the header name from the value */
+    *colon = '\0';
+    ptr = colon + 1;/* skip the colon */
+    while(iswhite(*ptr)) ptr++;/* skip whitespace */
+    last = add_header(h, line, colon - line, ptr, line + n - ptr);
   }
+
+  if(length && h->known[HEADER_CONTENT_LENGTH])
+    *length = strtoull(h->known[HEADER_CONTENT_LENGTH], NULL, 10);
+
+  return 0;
 }
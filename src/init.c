@@ -13,8 +13,11 @@ char *page_text[600];
 /* Initialises networking for serve. If it returns, it was successful.
    service should be the port to use
    *** Using service names instead of ports is not supported and may break CGI
+   If reuse is non-zero, the socket is opened with SO_REUSEPORT so that several
+   sockets can listen on the same port, and the kernel shares connections out
+   between them.
    Returns the file descriptor for the server */
-int init_net(const char *service) {
+int init_net(const char *service, int reuse) {
   struct addrinfo hints, *addr, *ptr;
   int fd, yes = 1;
 
@@ -33,9 +36,17 @@ int init_net(const char *service) {
 
   /* now go through the list of addresses and use the first available */
   for(ptr = addr; ptr; ptr = ptr->ai_next) {
-    /* try to make a socket with this address */
+    /* try to make a socket with this address; it's close-on-exec so that CGI
+       scripts can't accept connections on it */
+#ifdef SOCK_CLOEXEC
+    if((fd = socket(ptr->ai_family, SOCK_STREAM | SOCK_CLOEXEC,
+                    ptr->ai_protocol)) == -1)
+      continue;
+#else
     if((fd = socket(ptr->ai_family, SOCK_STREAM, ptr->ai_protocol)) == -1)
       continue;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
 
     /* try to allow this socket to be reuseable by a subsequent process */
     if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
@@ -43,6 +54,15 @@ int init_net(const char *service) {
       continue;
     }
 
+#ifdef SO_REUSEPORT
+    /* let several sockets listen on this port */
+    if(reuse &&
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+      close(fd);
+      continue;
+    }
+#endif
+
     /* and now bind to this socket */
     if(bind(fd, ptr->ai_addr, ptr->ai_addrlen) == -1) {
       close(fd);
@@ -62,13 +82,40 @@ int init_net(const char *service) {
     exit(1);
   }
 
+#ifdef TCP_DEFER_ACCEPT
+  /* don't wake us up until the client has actually sent something */
+  if(defer_accept) {
+    if(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                  sizeof(int)) == -1)
+      log_text(err, "Unable to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+    else
+      log_text(out, "Deferring accept for up to %d seconds.", defer_accept);
+  }
+#else
+  if(defer_accept) log_text(err, "TCP_DEFER_ACCEPT isn't available here.");
+#endif
+
+#ifdef TCP_FASTOPEN
+  /* let returning clients send their request along with the SYN */
+  if(fastopen) {
+    if(setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen,
+                  sizeof(int)) == -1)
+      log_text(err, "Unable to set TCP_FASTOPEN: %s", strerror(errno));
+    else
+      log_text(out, "TCP Fast Open queue length is %d.", fastopen);
+  }
+#else
+  if(fastopen) log_text(err, "TCP_FASTOPEN isn't available here.");
+#endif
+
   /* now let's get listening */
-  if(listen(fd, 10) == -1) {
+  if(listen(fd, backlog) == -1) {
     log_text(err, "Unable to listen on socket.");
     exit(1);
   }
 
-  log_text(out, "Listening on port '%s'", service);
+  log_text(out, "Listening on port '%s' with a backlog of %d", service,
+           backlog);
 
   /* our work here is done... */
   return fd;
@@ -129,6 +176,18 @@ void init_sighandlers(void) {
   /* clean up ghosted children */
   sa.sa_handler = ghost_buster;
   sigaction(SIGCHLD, &sa, NULL);
+
+  /* binary upgrades, see upgrade.c */
+  sa.sa_handler = request_upgrade;
+  sigaction(SIGUSR2, &sa, NULL);
+  sa.sa_handler = request_drain;
+  sa.sa_flags = SA_RESTART;/* don't interrupt a response that's being sent */
+  sigaction(SIGWINCH, &sa, NULL);
+
+  /* workers log their stats, see affinity.c */
+  sa.sa_handler = request_stats;
+  sa.sa_flags = 0;
+  sigaction(SIGUSR1, &sa, NULL);
 }
 
 /* Sets up the HTTP status reasons
@@ -184,6 +243,7 @@ void init_status_reason(void) {
   status_reason[416] = "Requested Range Not Satisfiable";
   status_reason[417] = "Expectation Failed";
   status_reason[418] = "I'm a teapot";/* RFC2324 (HTCPCP) only */
+  status_reason[431] = "Request Header Fields Too Large";/* RFC6585 */
 
   status_reason[500] = "Internal Server Error";
   page_text[500] = "The server is experiencing abnormal circumstances and was "
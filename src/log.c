@@ -28,7 +28,10 @@ void save_pid(int pid) {
     } else {
       fscanf(file, "%d", &n);
       fclose(file);
-      if(kill(n, 0) == -1) {
+      if(taking_over()) {
+        log_text(err, "'%s' belongs to the old server (pid %d), which is "
+                 "being replaced by this one.", pidfile, n);
+      } else if(kill(n, 0) == -1) {
         log_text(err, "'%s' already exists, but no process with pid %d is "
                  "running. Perhaps serve crashed or was forcibly killed. "
                  "Execution shall continue, but with no logging of the pid "
@@ -58,34 +61,32 @@ void save_pid(int pid) {
 
 /* log text to the given file, with date and time */
 void log_text(FILE *file, const char *fmt, ...) {
-  static time_t lasttim = -1;
-  static char date[64];
-  struct tm *tm_time;
+  char buf[1024];
   va_list args;
-  time_t tim;
+  size_t n;
   int len;
-  char *buf = malloc(1024);
 
   /* write date and time */
-  time(&tim);
-  if(tim != lasttim) {/* no point re-generating the text all the time */
-    lasttim = tim;
-    tm_time = localtime(&tim);
-    strftime(date, 64, "[%a %d %b %Y %T]", tm_time);
-  }
+  n = strlen(strcpy(buf, log_now()));
+  buf[n++] = ' ';
 
-  /* write text to string */
+  /* write text to string, so that the line goes out in one piece */
   va_start(args, fmt);
-  if((len = vsnprintf(buf, 1024, fmt, args)) > 1024) {
-    buf = realloc(buf, len + 1);
-    vsnprintf(buf, len + 1, fmt, args);
-  }
+  len = vsnprintf(buf + n, sizeof(buf) - n, fmt, args);
   va_end(args);
 
-  fprintf(file, "%s %s\n", date, buf);
+  if(len >= 0 && n + len < sizeof(buf) - 1) {
+    buf[n + len] = '\n';
+    fwrite(buf, 1, n + len + 1, file);
+  } else {/* too long for buf */
+    fwrite(buf, 1, n, file);
+    va_start(args, fmt);
+    vfprintf(file, fmt, args);
+    va_end(args);
+    fputc('\n', file);
+  }
+
   fflush(file);
-  
-  free(buf);
 }
 
 /* logs the request to the appropriate file */
@@ -96,7 +97,9 @@ void log_request(request *r) {
   if(r->status < 400) file = out;
   else file = err;
 
-  log_text(file, "[%s {%s}%s %lld] %d %s %s", r->client, r->user_agent,
-           r->encoding == GZIP ? " gz" : "", r->content_length, r->status,
+  log_text(file, "[%s {%s}%s%s %lld] %d %s %s", r->client, r->user_agent,
+           r->encoding != IDENTITY ? " " : "",
+           r->encoding != IDENTITY ? encoding_suffix[r->encoding] + 1 : "",
+           r->content_length, r->status,
            status_reason[r->status], r->req);
 }
@@ -6,6 +6,147 @@
 
 #include "serve.h"
 
+/* the connection that a handler process is dealing with has its input read in
+   large pieces and buffered here, so that reading a request doesn't take a
+   system call for every byte; anything else is read as it always was, because
+   whatever comes after a line in a pipe or a file might belong to somebody
+   else */
+static char *in_buf;
+static size_t in_len, in_pos, in_size;
+static int in_fd = -1;
+
+/* Throws away any input that has been buffered, and stops buffering */
+void forget_input(void) {
+  free(in_buf);
+  in_buf = NULL;
+  in_len = in_pos = in_size = 0;
+  in_fd = -1;
+}
+
+/* Buffers fd's input from now on (see above), keeping anything that has been
+   unread() for it */
+void buffer_input(int fd) {
+  if(fd == in_fd) return;
+
+  forget_input();
+  in_fd = fd;
+}
+
+/* Makes the next reads from fd (through nextline() and read_data()) return the
+   len bytes of buf before anything else, and buffers the rest of its input.
+   This is for when a connection moves in to a new process after some of its
+   input has already been read */
+void unread(int fd, const char *buf, size_t len) {
+  forget_input();
+  in_fd = fd;
+
+  if(len == 0) return;
+
+  in_buf = strdup2(buf, len);
+  in_len = in_size = len;
+}
+
+/* Reads as much as one read() will give us on to the end of the buffer.
+   Returns the number of bytes read, 0 at EOF, or -1 on error */
+static ssize_t fill(void) {
+  ssize_t n;
+
+  /* move what's left to the start, and make room for more */
+  if(in_pos) {
+    memmove(in_buf, in_buf + in_pos, in_len - in_pos);
+    in_len -= in_pos;
+    in_pos = 0;
+  }
+  if(in_size - in_len < READ_SIZE) {
+    in_size = in_len + READ_SIZE;
+    in_buf = realloc(in_buf, in_size);
+  }
+
+  while((n = read(in_fd, in_buf + in_len, in_size - in_len)) == -1 &&
+        errno == EINTR);
+
+  if(n > 0) in_len += n;
+
+  return n;
+}
+
+/* Like read(), but returns anything that has been buffered for fd first */
+ssize_t read_data(int fd, void *buf, size_t len) {
+  ssize_t n;
+
+  if(fd != in_fd) return read(fd, buf, len);
+
+  /* read small amounts in to the buffer, large ones straight in */
+  if(in_pos == in_len) {
+    if(len >= READ_SIZE) return read(fd, buf, len);
+    if((n = fill()) <= 0) return n;
+  }
+
+  len = MIN(len, in_len - in_pos);
+  memcpy(buf, in_buf + in_pos, len);
+  in_pos += len;
+
+  return len;
+}
+
+/* Returns the length of the line at the start of buf (len bytes long),
+   including the \n, or 0 if buf doesn't contain the whole line yet */
+static size_t line_length(const char *buf, size_t len) {
+  const char *nl = memchr(buf, '\n', len);
+
+  return nl ? nl + 1 - buf : 0;
+}
+
+/* Reads from fd (which must be buffered) until the buffer starts with a whole
+   piece of input as measured by length(), and returns a pointer to it, which
+   is only valid until the next read, with its length in *len.
+   Returns NULL if the connection is closed first, or with errno set to E2BIG if
+   the piece is more than max bytes long */
+static char *read_piece(size_t max, size_t *len,
+                        size_t (*length)(const char *buf, size_t len)) {
+  char *piece;
+  size_t n;
+
+  while(in_pos == in_len || !(n = length(in_buf + in_pos, in_len - in_pos))) {
+    if(in_len - in_pos > max) {
+      errno = E2BIG;
+      return NULL;
+    }
+    if(fill() <= 0) {
+      errno = 0;
+      return NULL;
+    }
+  }
+
+  if(n > max) {
+    errno = E2BIG;
+    return NULL;
+  }
+
+  piece = in_buf + in_pos;
+  in_pos += n;
+  *len = n;
+
+  return piece;
+}
+
+/* Returns a pointer to the next line of input read from the connection on fd,
+   including the endline, with its length in *len. The pointer is only valid
+   until the next read from fd.
+   Returns NULL if the connection is closed first, or with errno set to E2BIG if
+   the line is more than max bytes long */
+char *read_line(int fd, size_t max, size_t *len) {
+  buffer_input(fd);
+  return read_piece(max, len, line_length);
+}
+
+/* Like read_line(), but returns the whole block of headers, up to and including
+   the blank line that ends it (see headers_length()) */
+char *read_headers(int fd, size_t max, size_t *len) {
+  buffer_input(fd);
+  return read_piece(max, len, headers_length);
+}
+
 /* Returns a pointer to a new array containing the next line of input read from
    the given file descriptor, or NULL on error or if at EOF upon function entry
    You should free the returned pointer yourself when you are done with it */
@@ -16,6 +157,11 @@ char *nextline(int fd) {
   int n;
   size_t len = 128;/* reduce likelihood of expensive realloc */
 
+  if(fd == in_fd) {
+    if(!(line = read_piece((size_t)-1, &len, line_length))) return NULL;
+    return strdup2(line, len);
+  }
+
   line = malloc(len);
 
   /* loop until we read an endline */
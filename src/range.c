@@ -0,0 +1,238 @@
+/* Byte ranges for serve
+
+   A client that only wants part of a file, to carry on with a download or to
+   skip to somewhere in a video, asks for it with a Range header, and gets
+   just those bytes back in a 206 response. More than one range comes back as
+   a multipart/byteranges body, with a small header before each part saying
+   which bytes it is. If none of the ranges are in the file, the client gets a
+   416 instead. The parts are sent straight from the file, like the rest of
+   it would have been.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+/* how many random bytes a multipart boundary is made from */
+#define BOUNDARY_BYTES 16
+
+/* Reads a number at *p in to *n, and moves *p past it.
+   Returns 0 on success, or -1 if there isn't one or it's too big */
+static int get_offset(const char **p, long long *n) {
+  const char *start = *p;
+
+  for(*n = 0; isdigit((unsigned char)**p); (*p)++) {
+    if(*n > (LLONG_MAX - 9) / 10) return -1;
+    *n = *n * 10 + **p - '0';
+  }
+
+  return (*p > start) ? 0 : -1;
+}
+
+/* Returns 1 if the If-Range header of the given request (if any) says that
+   the client's copy of the file is the one we have, or 0 if not */
+static int same_version(request *r) {
+  size_t len;
+
+  if(!r->if_range) return 1;
+  len = strlen(r->etag);
+
+  /* a weak tag isn't good enough to put parts of two copies together */
+  if(r->if_range[0] == '"')
+    return strncmp(r->if_range + 1, r->etag, len) == 0 &&
+      strcmp(r->if_range + len + 1, "\"") == 0;
+  if(strncmp(r->if_range, "W/", 2) == 0) return 0;
+
+  return get_date(r->if_range) == r->last_modified_t;
+}
+
+/* Sorts the ranges of the given request by where they start, and joins up
+   any that overlap or touch, so that asking for the same bytes over and over
+   again can't make the response any bigger than the file */
+static void merge_ranges(request *r) {
+  byte_range tmp;
+  int i, j;
+
+  for(i = 1; i < r->num_ranges; i++) {
+    tmp = r->ranges[i];
+    for(j = i; j > 0 && r->ranges[j - 1].start > tmp.start; j--)
+      r->ranges[j] = r->ranges[j - 1];
+    r->ranges[j] = tmp;
+  }
+
+  for(i = 0, j = 1; j < r->num_ranges; j++) {
+    if(r->ranges[j].start <= r->ranges[i].start + r->ranges[i].len)
+      r->ranges[i].len = MAX(r->ranges[i].len, r->ranges[j].start +
+                             r->ranges[j].len - r->ranges[i].start);
+    else
+      r->ranges[++i] = r->ranges[j];
+  }
+  if(r->num_ranges) r->num_ranges = i + 1;
+}
+
+/* Puts a boundary for a multipart response in boundary, which has room for
+   2 * BOUNDARY_BYTES + 1 bytes. It's random, so that nobody can know it in
+   advance and put it in a file */
+static void make_boundary(char *boundary) {
+  unsigned char bytes[BOUNDARY_BYTES];
+  int i;
+
+#ifdef __linux__
+  /* if the kernel is too old for getrandom(), random() is better than
+     nothing */
+  if(getrandom(bytes, BOUNDARY_BYTES, 0) != BOUNDARY_BYTES)
+    for(i = 0; i < BOUNDARY_BYTES; i++) bytes[i] = random() ^ time(NULL);
+#else
+  arc4random_buf(bytes, BOUNDARY_BYTES);
+#endif
+
+  for(i = 0; i < BOUNDARY_BYTES; i++)
+    sprintf(boundary + 2 * i, "%02x", bytes[i]);
+}
+
+/* Works out which parts of the file the Range header of the given request
+   asks for, once file_stuff() has found out how big it is, and puts them in
+   r->ranges (up to MAX_RANGES of them), leaving out any that start past the
+   end of the file, and joining up any that overlap or touch.
+   Returns the number of ranges, which is 0 if none of them are in the file,
+   or -1 if the header should be ignored and the whole file sent, because it
+   doesn't make sense or is for a different version of the file */
+int get_ranges(request *r) {
+  long long size = r->content_length;
+  const char *p = r->range;
+  long long start, end;
+  int specs = 0;
+
+  if(!same_version(r)) return -1;
+
+  if(strncasecmp(p, "bytes=", 6) != 0) return -1;
+  p += 6;
+
+  r->ranges = arena_alloc(r->arena, MAX_RANGES * sizeof(byte_range));
+  r->num_ranges = 0;
+
+  while(*p) {
+    if(*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+      continue;
+    }
+
+    if(*p == '-') {/* "-500" is the last 500 bytes */
+      p++;
+      if(get_offset(&p, &end) == -1) return -1;
+      start = MAX(size - end, 0);
+      if(!end) start = size;/* which is past the end */
+      end = size - 1;
+    } else {/* "500-999", or "500-" for everything from 500 */
+      if(get_offset(&p, &start) == -1 || *p++ != '-') return -1;
+      if(!isdigit((unsigned char)*p)) end = size - 1;
+      else if(get_offset(&p, &end) == -1 || end < start) return -1;
+      end = MIN(end, size - 1);
+    }
+
+    for(; *p == ' ' || *p == '\t'; p++);
+    if(*p && *p != ',') return -1;
+    specs++;
+
+    if(start >= size) continue;
+    if(r->num_ranges == MAX_RANGES) return -1;
+
+    r->ranges[r->num_ranges].start = start;
+    r->ranges[r->num_ranges].len = end - start + 1;
+    r->num_ranges++;
+  }
+
+  if(!specs) return -1;
+
+  merge_ranges(r);
+  return r->num_ranges;
+}
+
+/* Sends the parts of the file that get_ranges() found for the given request,
+   or a 416 if there aren't any */
+void send_ranges(request *r) {
+  char boundary[2 * BOUNDARY_BYTES + 1];
+  unsigned long long size = r->content_length;
+  char *type = r->content_type;
+  char **part;
+  char *end;
+  off_t last;
+  size_t n;
+  int fildes = -1;
+  int i;
+
+  if(!r->num_ranges) {
+    r->status = 416;
+    r->content_range = arena_alloc(r->arena, decimal_length(size) + 8);
+    sprintf(r->content_range, "bytes */%llu", size);
+    send_errorpage(r);
+    return;
+  }
+
+  if(!r->body && (fildes = open_file(r)) == -1) {
+    log_text(err, "Unable to open %s for reading.", r->file);
+    r->status = 500;
+    send_errorpage(r);
+    return;
+  }
+
+  r->status = 206;
+  r->encoding = IDENTITY;
+
+  if(r->num_ranges == 1) {
+    last = r->ranges[0].start + r->ranges[0].len - 1;
+    r->content_length = r->ranges[0].len;
+    r->content_range = arena_alloc(r->arena, 3 * decimal_length(size) + 9);
+    sprintf(r->content_range, "bytes %llu-%llu/%llu",
+            (unsigned long long)r->ranges[0].start, (unsigned long long)last,
+            size);
+
+    send_headers(r, NULL, NULL, NULL, 0, 1);
+    if(send_part(r, fildes, r->ranges[0].start, r->ranges[0].len) == -1)
+      r->close_conn = 1;
+  } else {
+    /* the boundary just has to be something that isn't in the file */
+    make_boundary(boundary);
+    r->content_type = NULL;
+    n = 0;
+    add_text(r->arena, &r->content_type, &n,
+             "multipart/byteranges; boundary=%s", boundary);
+
+    /* the length of the whole body has to be known before it's sent */
+    part = arena_alloc(r->arena, r->num_ranges * sizeof(char*));
+    r->content_length = 0;
+    for(i = 0; i < r->num_ranges; i++) {
+      last = r->ranges[i].start + r->ranges[i].len - 1;
+      part[i] = NULL;
+      n = 0;
+      add_text(r->arena, &part[i], &n, "%s--%s\r\nContent-Type: %s\r\n"
+               "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+               i ? "\r\n" : "", boundary, type,
+               (unsigned long long)r->ranges[i].start, (unsigned long long)last,
+               size);
+      r->content_length += n + r->ranges[i].len;
+    }
+    end = NULL;
+    n = 0;
+    add_text(r->arena, &end, &n, "\r\n--%s--\r\n", boundary);
+    r->content_length += n;
+
+    send_headers(r, NULL, NULL, NULL, 0, 1);
+    for(i = 0; i < r->num_ranges; i++) {
+      if(send_bytes(r, part[i], strlen(part[i]), 1) == -1 ||
+         send_part(r, fildes, r->ranges[i].start, r->ranges[i].len) == -1) {
+        r->close_conn = 1;
+        break;
+      }
+    }
+    if(i == r->num_ranges && send_bytes(r, end, strlen(end), 0) == -1)
+      r->close_conn = 1;
+  }
+
+  if(fildes != -1) close(fildes);
+}
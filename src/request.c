@@ -6,31 +6,32 @@
 
 #include "serve.h"
 
-/* closes the connection and free's all the content */
+/* Returns a new, empty request with its own arena, which everything that
+   belongs to the request is allocated from */
+static request *new_request(void) {
+  arena *a = new_arena();
+  request *r = arena_alloc(a, sizeof(request));
+
+  memset(r, '\0', sizeof(request));
+  r->arena = a;
+  r->fildes = -1;
+  no_copies(&r->copies);
+
+  return r;
+}
+
+/* frees the request and all of its content */
 void free_request(request *r) {
-  free(r->user_agent);
-  free(r->client);
-  free(r->req);
-  free(r->reqfile);
-  free(r->file);
-  free(r->http);
-  free(r->content_type);
-  free(r->last_modified);
-  free(r->date);
-  if(r->post_data) free(r->post_data);
-  free(r->auth_realm);
-  free(r->auth_user);
-  free(r->doc_root);
-  free(r->location);
-  free(r->host);
-  free_headers(r->header_list, r->num_headers);
-  free(r);
+  free_headers(&r->headers);
+  if(r->fildes != -1) close(r->fildes);
+  close_copies(&r->copies);
+  free_arena(r->arena);
 }
 
 /* fills in sensible defaults for required values */
 void fix_request(request *r) {
-  if(!r->http) r->http = strdup("HTTP/1.0");
-  if(!r->file) r->file = strdup(".");
+  if(!r->http) r->http = arena_strdup(r->arena, "HTTP/1.0");
+  if(!r->file) r->file = arena_strdup(r->arena, ".");
 }
 
 /* fills in file-based stuff in the request structure */
@@ -38,7 +39,6 @@ void file_stuff(request *r) {
   int fildes;
   int len;
   struct stat statbuf;
-  struct tm *tm_time;
 
   /* no file */
   if(!r->file) {
@@ -46,9 +46,6 @@ void file_stuff(request *r) {
     return;
   }
 
-  free(r->content_type);
-  r->content_type = strdup(content_type(r->file));
-
   /* forbidden path */
   if(forbidden(r->file)) {
     r->status = 403;
@@ -58,12 +55,29 @@ void file_stuff(request *r) {
   /* built-in image? */
   /* skip one out because of the / at the start */
   if(strncmp(r->file, IMAGE_PATH, strlen(IMAGE_PATH)) == 0) {
+    r->content_type = arena_strdup(r->arena, content_type(r->file));
     builtin_file_stuff(r);
     return;
   }
 
-  /* check file exists */
-  if(stat(r->file, &statbuf) != 0) {
+  /* any compressed copies that have been found are of some other file */
+  if(!r->stat_file || strcmp(r->stat_file, r->file) != 0)
+    close_copies(&r->copies);
+
+  /* the shared cache may have the whole file, or the file cache may know all
+     about it already */
+  if(use_shm_file(r)) return;
+  if(use_cached_file(r)) {
+    shm_cache_file(r);
+    return;
+  }
+
+  r->content_type = arena_strdup(r->arena, content_type(r->file));
+
+  /* check file exists, unless the filesystem pool already has */
+  if(r->stat_file && strcmp(r->stat_file, r->file) == 0)
+    statbuf = r->statbuf;
+  else if(stat(r->file, &statbuf) != 0) {
     r->status = 404;
     return;
   }
@@ -75,60 +89,90 @@ void file_stuff(request *r) {
     /* redirect if a directory was requested without ending with a '/' */
     if(r->reqfile[len - 1] != '/') {
       r->status = 301;
-      r->location = malloc(len + 2);
+      r->location = arena_alloc(r->arena, len + 2);
       strcpy(r->location, r->reqfile);
       strcpy(r->location + len, "/");
     }
   } else {
     r->is_dir = 0;
-    /* not a directory, check if file can be read from */
-    if((fildes = open(r->file, O_RDONLY)) < 0) {
-      r->status = 403;
-      return;
+    /* not a directory, check if file can be read from, unless the filesystem
+       pool has already opened it; it's kept open for sending */
+    if(r->fildes == -1 || strcmp(r->stat_file, r->file) != 0) {
+      if((fildes = open(r->file, O_RDONLY | O_CLOEXEC)) < 0) {
+        r->status = 403;
+        return;
+      }
+      if(r->fildes != -1) close(r->fildes);
+      r->fildes = fildes;
+      r->read_ahead = 0;
+      r->stat_file = r->file;
     }
-    close(fildes);
   }
 
   /* WARNING: Only responses with status code 200 have content_length and
      last_modified! */
 
   r->last_modified_t = statbuf.st_mtime;
-  tm_time = gmtime(&statbuf.st_mtime);
-  if(!r->last_modified) r->last_modified = malloc(64);
-  strftime(r->last_modified, 64, "%a, %d %b %Y %T GMT", tm_time);
+  if(!r->last_modified)
+    r->last_modified = arena_alloc(r->arena, HTTP_DATE_SIZE);
+  http_date(statbuf.st_mtime, r->last_modified);
 
   r->content_length = statbuf.st_size;
+  r->statbuf = statbuf;
+
+  /* a file's compressed copies are looked for, unless the filesystem pool has
+     done it already; scripts don't have any */
+  if(!r->is_dir && !r->copies.known) {
+    if(r->content_type[0] == '/') r->copies.known = 1;
+    else find_copies(r->file, &statbuf, &r->copies);
+  }
+
+  /* in an event loop these stat() the file and its directory, watch them
+     and read a small file on the loop itself rather than in the filesystem
+     pool, since the caches belong to the loop; it's only once for each
+     file, which has just been looked up and opened, so it's cached */
+  cache_file(r);
+  shm_cache_file(r);
 }
 
-/* creates a request structure with all the relevant information */
-request *request_info(int fd, const char *addr, const char *req) {
-  struct tm *tm_time;
+/* creates a request structure with the information from the request line,
+   leaving the file itself to file_stuff() */
+request *parse_request(int fd, const char *addr, const char *line,
+                       size_t line_len) {
+  char cwd[PATH_MAX];
   request *r;
-  time_t tim;
-  int len = PATH_MAX;
+  const char *tok[3];
+  size_t tok_len[3];
+  int bad;
 
-  r = calloc(1, sizeof(request));
+  r = new_request();
+  r->req = arena_strndup(r->arena, line, line_len);
+  stripendl(r->req);
+
+  /* eg. "GET /filename HTTP/1.1" */
+  bad = split_request(r->req, tok, tok_len);
 
   r->fd = fd;
-  r->client = strdup((char*)addr);
-  r->req = (char*)req;
-  r->meth = method_type(req);
-  r->reqfile = requ_file(req);
-  r->file = filename(r->reqfile);
-  r->http = http_version(req);
+  r->client = arena_strdup(r->arena, addr);
+  r->meth = method_type(tok[0], tok_len[0]);
+  r->reqfile = arena_strndup(r->arena, tok[1], tok_len[1]);
+  r->file = filename(r->arena, r->reqfile);
+  r->http = tok_len[2] ? arena_strndup(r->arena, tok[2], tok_len[2]) : NULL;
   r->status = 200;
   r->keep_alive = 300;
 
   /* get the document root */
-  r->doc_root = malloc(len);
-  while((getcwd(r->doc_root, len++)) == NULL)
-    r->doc_root = realloc(r->doc_root, len);
+  r->doc_root = arena_strdup(r->arena, getcwd(cwd, sizeof(cwd)) ? cwd : ".");
 
   /* get date */
-  time(&tim);
-  tm_time = gmtime(&tim);
-  r->date = malloc(64);
-  strftime(r->date, 64, "%a, %d %b %Y %T GMT", tm_time);
+  r->date = arena_strdup(r->arena, http_now());
+
+  /* bytes that can't be in a request; there's no telling where it ends */
+  if(bad) {
+    r->close_conn = 1;
+    r->status = 400;
+    return r;
+  }
 
   /* bad method */
   if(r->meth == INVALID) {
@@ -166,62 +210,80 @@ request *request_info(int fd, const char *addr, const char *req) {
   /* close connection for HTTP 1.0 */
   if(strcmp(r->http, "HTTP/1.0") == 0) r->close_conn = 1;
 
-  file_stuff(r);
-
   return r;
 }
 
-int iswhite(char c) {
-  return (c == ' ') || (c == '\t');
-}
+/* creates a request structure with nothing in it but the given error status,
+   for a client whose request couldn't be read */
+request *bare_request(int fd, const char *addr, int status) {
+  request *r = new_request();
 
-/* Find the method type in buf
-   Returns a method number (see serve.h) or -1 if no/invalid method */
-int method_type(const char *buf) {
-  char *ptr, *end;
-  int i;
+  r->fd = fd;
+  r->client = addr ? arena_strdup(r->arena, addr) : NULL;
+  r->req = arena_strdup(r->arena, "");
+  r->http = arena_strdup(r->arena, "HTTP/1.0");
+  r->status = status;
+  r->meth = GET;
+  r->close_conn = 1;
 
-  /* e.g. "GET /filename HTTP/1.1" */
+  return r;
+}
 
-  /* skip whitespace at start */
-  for(ptr = (char*)buf; *ptr && iswhite(*ptr); ptr++);
+/* creates a request structure with all the relevant information, from the
+   request line and the file it asks for */
+request *request_info(int fd, const char *addr, const char *line,
+                      size_t len) {
+  request *r = parse_request(fd, addr, line, len);
 
-  /* now find the end of the non-whitespace */
-  for(end = ptr; *end && !iswhite(*end); end++);
+  if(r->status == 200) file_stuff(r);
 
-  /* and now find the method number */
-  for(i = 0; i < METHODS; i++) {
-    if(strncasecmp(method[i], ptr, end-ptr) == 0) return i;
-  }
+  return r;
+}
 
-  /* invalid method */
-  return -1;
+int iswhite(char c) {
+  return (c == ' ') || (c == '\t');
 }
 
-/* Extracts the filename from the request.
-   new array. You must free the new array when you are done with it. */
-char *requ_file(const char *buf) {
-  char *ptr, *end;
-  char *reqfile;
+/* Splits the request line req in to its method, file and HTTP version in one
+   pass, putting the start of each in tok and its length in len (0 if it's
+   missing, or after a control character). Anything after the HTTP version is
+   ignored.
+   Returns 0 on success, or -1 if req contains a control character */
+int split_request(const char *req, const char **tok, size_t *len) {
+  const char *p = req;
+  const char *end = req + strlen(req);
+  int i;
 
-  /* eg. "GET /filename HTTP/1.1" */
+  /* tokens after a control character are left empty */
+  for(i = 0; i < 3; i++) {
+    tok[i] = end;
+    len[i] = 0;
+  }
 
-  /* skip whitespace at start */
-  for(ptr = (char*)buf; *ptr && iswhite(*ptr); ptr++);
+  for(i = 0; i < 3; i++) {
+    /* skip whitespace before it, then find the end of it */
+    while(iswhite(*p)) p++;
+    tok[i] = p;
+    p = scan(p, end, ' ', '\t');
+    len[i] = p - tok[i];
 
-  /* now find the end of the method */
-  for(; *ptr && !iswhite(*ptr); ptr++);
+    if(p < end && !iswhite(*p)) return -1;
+  }
 
-  /* now skip more whitespace */
-  for(; *ptr && iswhite(*ptr); ptr++);
+  return scan(p, end, '\0', '\0') == end ? 0 : -1;
+}
 
-  /* and find the end of the filename */
-  for(end = ptr; *end && !iswhite(*end); end++);/* find space */
+/* Returns the number of the method named by the len bytes at buf (see serve.h)
+   or -1 if no/invalid method */
+int method_type(const char *buf, size_t len) {
+  int i;
 
-  /* allocate the path */
-  reqfile = strdup2(ptr, end - ptr);
+  for(i = 0; i < METHODS; i++) {
+    if(strncasecmp(method[i], buf, len) == 0 && !method[i][len]) return i;
+  }
 
-  return reqfile;
+  /* invalid method */
+  return -1;
 }
 
 /* convents the given character to a number, 0 to 15
@@ -235,93 +297,120 @@ int hex_to_digit(char c) {
   }
 }
 
-/* url decodes the contents of buf, and places the decoded version back in buf
-   Returns buf, or NULL on error */
-char *url_decode(char *buf) {
-  char *ptr = buf;
-  int i;
+/* Takes the segment of the path being written to out that ends at o back out
+   if it's ".", or it and the one before it if it's "..", along with the slash
+   before that. A ".." with nothing after floor to go back over is left for
+   forbidden() to refuse, and moves floor past it.
+   Returns where the path now ends */
+static char *dot_segment(char *out, char *o, char **floor) {
+  if(o > out && o[-1] == '.' && (o - out == 1 || o[-2] == '/')) {
+    o--;
+  } else if(o - out >= 2 && o[-1] == '.' && o[-2] == '.' &&
+            (o - out == 2 || o[-3] == '/')) {
+    if(o - 2 == *floor) {
+      *floor = o + 1;
+      return o;
+    }
+    for(o -= 3; o > *floor && o[-1] != '/'; o--);
+  } else {
+    return o;
+  }
+
+  if(o > out) o--;
+  return o;
+}
+
+/* url decodes the path from p up to end, and collapses the slashes and the
+   . and .. segments in it as it goes, all in one pass, writing the result to
+   out. Slashes at the start are dropped, and any other run of them becomes
+   one. The decoding stops being written at a decoded NUL, but the rest is
+   still checked.
+   Returns the length written, or -1 if there's a bad % escape */
+static int decode_path(const char *p, const char *end, char *out) {
+  const char *q;
+  char *o = out;
+  char *floor = out;/* where the segments that can be gone back over start */
+  int slash = 0;/* a slash is waiting for something to come after it */
+  int nul = 0;
   int c = 0, c2;
-  int state = TEXT;
-
-  for(i = 0; *ptr; ptr++) {
-    switch(state) {
-    case TEXT:
-      if(*ptr == '%')	state = HEX1;
-      else buf[i++] = *ptr;
-      break;
-    case HEX1:
-      /* convert to a value and put in c */
-      if((c = hex_to_digit(*ptr)) < 0) return NULL;
-      state = HEX2;
-      break;
-    case HEX2:
-      /* convert to a value, put in c2, and add the character */
-      if((c2 = hex_to_digit(*ptr)) < 0) return NULL;
-      buf[i++] = (c << 4) | c2;
-      state = TEXT;
-      break;
+
+  while(p < end) {
+    /* copy everything up to the next % or / in one go */
+    if((q = scan(p, end, '%', '/')) > p) {
+      if(!nul) {
+        if(slash) *o++ = '/';
+        memcpy(o, p, q - p);
+        o += q - p;
+        slash = 0;
+      }
+      p = q;
+      continue;
+    }
+
+    if(*p == '/') {
+      c = '/';
+      p++;
+    } else if(*p == '%') {
+      /* a % too near the end is ignored, as long as what's there is hex */
+      if(p + 1 < end && (c = hex_to_digit(p[1])) < 0) return -1;
+      if(p + 2 >= end) break;
+      if((c2 = hex_to_digit(p[2])) < 0) return -1;
+      c = (c << 4) | c2;
+      p += 3;
+    } else {/* a control character, which is just copied */
+      c = *p++;
+    }
+
+    if(nul) continue;
+
+    if(c == '\0') {
+      nul = 1;
+    } else if(c == '/') {
+      if(!slash) o = dot_segment(out, o, &floor);
+      slash = (o > out);
+    } else {
+      if(slash) *o++ = '/';
+      *o++ = c;
+      slash = 0;
     }
   }
 
-  buf[i] = '\0';
+  if(!slash) o = dot_segment(out, o, &floor);
+  if(slash) *o++ = '/';
 
-  return buf;
+  return o - out;
 }
 
-/* Takes the given requ_file()-returned name, sorts out user directories, url
-   decodes it, and places it in a new array. You must free the new array when
-   you are done with it.
+/* Takes the given file name from a request line (see split_request()), sorts
+   out user directories, url decodes it, and places it in a new array
+   allocated from a.
    Returns NULL if the filename given can not be url decoded. */
-char *filename(const char *buf) {
-  char *ptr, *end;
-  char *p, *s;
-  char *path, *newpath;
+char *filename(arena *a, const char *buf) {
+  const char *end;
+  char *ptr, *newpath;
   struct passwd *pw;
-  char *user = NULL;
-  int len, userdir = 0;
+  int len;
 
   /* no path given, get root */
-  if(*buf == '\0') return strdup(".");
+  if(*buf == '\0') return arena_strdup(a, ".");
 
   /* get just the file part */
-  ptr = (char*)buf;
-  while(iswhite(*ptr)) ptr++;
-	
-  /* get a url decoded copy */
-  if((end = strchr(ptr, '?'))) path = strdup2(ptr, end - ptr);
-  else path = strdup(ptr);
-  if(url_decode(path) == NULL) {
-    free(path);
-    return NULL;
-  }
-  ptr = path;
-
-  /* sort out leading slashes */
-  while(*ptr == '/') ptr++;
-
-  /* sort out double slashes */
-  for(p = ptr, s = ptr; *s; s++) {
-    if(*s != '/') *p++ = *s;
-    else if(*(s+1) != '/') *p++ = *s;
-  }
-  *p = '\0';
-  len = strlen(ptr);
+  while(iswhite(*buf)) buf++;
+  if(!(end = strchr(buf, '?'))) end = buf + strlen(buf);
 
-  /* sort out trailing /. */
-  if(len >= 2)
-    if((ptr[len - 1] == '.') && (ptr[len - 2] == '/')) len--;
+  /* get a url decoded copy with the slashes sorted out; it's never longer than
+     what it's decoded from, except that "." might be needed */
+  ptr = arena_alloc(a, MAX(end - buf, 1) + 1);
+  if((len = decode_path(buf, end, ptr)) == -1) return NULL;
 
   /* sort out trailing slashes */
-  while((ptr[len - 1] == '/') && (len > 0)) len--;
+  while((len > 0) && (ptr[len - 1] == '/')) len--;
 
   /* NUL-terminate */
   ptr[len] = '\0';
 
   /* sort out empty path */
-  if(len == 0) {
-    free(path);
-    ptr = path = strdup(".");
-  }
+  if(len == 0) strcpy(ptr, ".");
 
   /* and now get user directories */
   /* Valgrind complains about using getpwnam() because it allocates a buffer
@@ -329,33 +418,24 @@ char *filename(const char *buf) {
      subsequent calls to getpwnam(). */
   if(*ptr == '~') {
     if((end = strchr(ptr, '/'))) {/* user directory at start of path */
-      user = strdup2(ptr + 1, end - (ptr + 1));
-      pw = getpwnam(user);
+      pw = getpwnam(arena_strndup(a, ptr + 1, end - (ptr + 1)));
     } else {/* index */
       end = ptr + len;
       pw = getpwnam(ptr + 1);
     }
     if(pw) {/* user exists, construct path */
-      userdir = 1;
       len = strlen(pw->pw_dir);
-      newpath = malloc(len + /* strlen("/public_html") */ 12 +
-                       strlen(end) + 1);
+      newpath = arena_alloc(a, len + /* strlen("/public_html") */ 12 +
+                            strlen(end) + 1);
       strcpy(newpath, pw->pw_dir);
       if(newpath[len - 1] != '/') newpath[len++] = '/';
       strcpy(newpath + len, "public_html");
       strcpy(newpath + len + /* strlen("public_html") */ 11, end);
-      free(path);
-      free(user);
+      return newpath;
     }
   }
 
-  /* sort out the path if it's not a userdir */
-  if(!userdir) {
-    newpath = strdup(ptr);
-    free(path);
-  }
-
-  return newpath;
+  return ptr;
 }
 
 /* Removes \r and \n characters from the end of buf
@@ -375,70 +455,29 @@ char *stripendl(char *buf) {
   return buf;
 }
 
-/* Returns a pointer to the place in buf where the HTTP version starts or NULL
-   if none is found */
-char *http_version(const char *buf) {
-  char *ptr;
-  char *p;
-
-  /* eg. "GET /filename HTTP/1.1" */
-
-  /* skip whitespace at start */
-  for(ptr = (char*)buf; *ptr && iswhite(*ptr); ptr++);
-
-  /* now find the end of the method */
-  for(; *ptr && !iswhite(*ptr); ptr++);
-
-  /* now skip more whitespace */
-  for(; *ptr && iswhite(*ptr); ptr++);
-
-  /* now find the end of the filename */
-  for(; *ptr && !iswhite(*ptr); ptr++);
-
-  /* and now skip over the last of the whitespace */
-  for(; *ptr && iswhite(*ptr); ptr++);
-
-  if(!*ptr) return NULL;
-
-  /* copy the string */
-  p = strdup(ptr);
-  
-  /* strip trailing whitespace */
-  for(ptr = p; *ptr && !iswhite(*ptr); ptr++);
-  *ptr = '\0';
-
-  return p;
-}
-
 /* Returns 1 if the given file is forbidden and 0 otherwise */
 int forbidden(const char *file) {
-  char *ptr;
+  const char *ptr, *last;
   int level = 0;
 
-  if(!file) return 0;
+  if(!file || !*file) return 0;
 
-  /* Deny files beginning with a ., except . the directory */
+  /* Deny files beginning with a ., except . the directory, and so anything
+     starting with ../ */
   if((*file == '.') && file[1] && file[1] != '/') return 1;
-  ptr = strrchr(file, '/');
-  if(ptr) {
-    if(*(ptr+1) == '.') return 1;
-  }
-
-  /* And deny anything that tries to go above the current working directory */
-
-  /* special case that isn't a /../ */
-  if(strncmp(file, "../", 3) == 0) return 1;
 
-  /* Look for the next /. If it is a /../, decrement the level, if it is not a
-     /./, increment the level. If we ever end up lower than where we started, it
-     is forbidden */
-  ptr = (char*)file;
-  while((ptr = strchr(ptr+1, '/'))) {
+  /* Go along the slashes once. If it is a /../, decrement the level, if it is
+     not a /./, increment the level. If we ever end up lower than where we
+     started, it is trying to go above the current working directory and is
+     forbidden */
+  last = (*file == '/') ? file : NULL;
+  for(ptr = file; (ptr = strchr(ptr + 1, '/')); last = ptr) {
     if(strncmp(ptr, "/../", 4) == 0) level--;
     else if(strncmp(ptr, "/./", 3) != 0) level++;
 
     if(level < 0) return 1;
   }
 
-  return 0;
+  /* And deny a file whose name begins with a . */
+  return last && last[1] == '.';
 }
@@ -0,0 +1,118 @@
+/* Byte scanning for serve
+
+   Reading a request mostly means looking for the next space, colon or end of
+   line, and any byte that shouldn't be there. scan() does that 32 bytes at a
+   time with AVX2 or 16 at a time with SSE2, whichever the CPU has, and a byte
+   at a time otherwise.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#if defined(USE_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Returns 1 if c is a control character other than tab, and 0 otherwise */
+static int iscontrol(unsigned char c) {
+  return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+static const char *scan_bytes(const char *p, const char *end, char a, char b) {
+  for(; p < end; p++)
+    if(*p == a || *p == b || iscontrol(*p)) break;
+
+  return p;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const char *scan_sse2(const char *p, const char *end, char a, char b) {
+  __m128i lim = _mm_set1_epi8(0x1f);
+  __m128i tab = _mm_set1_epi8('\t');
+  __m128i del = _mm_set1_epi8(0x7f);
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i v, m;
+  int mask;
+
+  for(; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i*)p);
+
+    /* bytes up to 0x1f, apart from tab, then 0x7f, a and b */
+    m = _mm_cmpeq_epi8(_mm_min_epu8(v, lim), v);
+    m = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab), m);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, va));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, vb));
+
+    if((mask = _mm_movemask_epi8(m))) return p + __builtin_ctz(mask);
+  }
+
+  return scan_bytes(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *p, const char *end, char a, char b) {
+  __m256i lim = _mm256_set1_epi8(0x1f);
+  __m256i tab = _mm256_set1_epi8('\t');
+  __m256i del = _mm256_set1_epi8(0x7f);
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i v, m;
+  unsigned int mask;
+
+  for(; end - p >= 32; p += 32) {
+    v = _mm256_loadu_si256((const __m256i*)p);
+
+    m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v);
+    m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), m);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, del));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, va));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, vb));
+
+    if((mask = _mm256_movemask_epi8(m))) {
+      _mm256_zeroupper();
+      return p + __builtin_ctz(mask);
+    }
+  }
+
+  /* SSE code that runs while the top halves of the AVX registers are in use
+     is very slow, and gcc only clears them itself when optimising */
+  _mm256_zeroupper();
+
+  /* the last few bytes are usually the end of the line anyway */
+  return scan_sse2(p, end, a, b);
+}
+#endif
+
+static const char *(*scanner)(const char *p, const char *end, char a,
+                              char b) = scan_bytes;
+
+char *scanner_name = "byte by byte";
+
+/* Picks the fastest way of scanning that this CPU supports */
+void init_scan(void) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2")) {
+    scanner = scan_avx2;
+    scanner_name = "with AVX2";
+  } else if(__builtin_cpu_supports("sse2")) {
+    scanner = scan_sse2;
+    scanner_name = "with SSE2";
+  }
+#endif
+}
+
+/* Returns a pointer to the first byte from p up to end that is a or b, or is a
+   control character other than tab (which includes \r and \n), or end if there
+   isn't one */
+const char *scan(const char *p, const char *end, char a, char b) {
+  return scanner(p, end, a, b);
+}
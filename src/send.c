@@ -6,6 +6,15 @@
 
 #include "serve.h"
 
+#include <poll.h>
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/* the most that Linux's sendfile() sends in one go */
+#define MAX_SENDFILE 0x7ffff000
+
 /* This function closes the process if the client disconnects.
    Yeah, I know. */
 ssize_t send_str(int fd, const char *str) {
@@ -18,116 +27,580 @@ ssize_t send_str(int fd, const char *str) {
   return n;
 }
 
-/* Sends a response code to the client */
-void send_response(request *r) {
-  char *buf;
-  int len;
+/* Sends all len bytes of buf to the blocking socket fd, carrying on if a
+   signal interrupts it part way.
+   Returns 0 on success, or -1 on error */
+static int send_all(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while(len > 0) {
+    if((n = send(fd, buf, len, 0)) == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Waits for there to be room to send more to the socket fd.
+   Returns 0 when there is, or -1 if there isn't within SEND_TIMEOUT
+   seconds */
+static int wait_writable(int fd) {
+  struct pollfd p;
+  int n;
+
+  p.fd = fd;
+  p.events = POLLOUT;
+
+  do {
+    n = poll(&p, 1, SEND_TIMEOUT * 1000);
+  } while(n == -1 && errno == EINTR);
+
+  return (n > 0) ? 0 : -1;
+}
+
+/* Sends up to len bytes of the file open on fildes, starting at *offset, to
+   the socket fd, and moves *offset past whatever was sent. On Linux the file
+   goes straight from the page cache with sendfile(), unless it's a kind of
+   file that sendfile() can't do; otherwise it's read and sent a chunk at a
+   time.
+   Returns the number of bytes sent, 0 if the file has ended, or -1 on error
+   (which is EAGAIN if fd is non-blocking and full) */
+ssize_t send_file_part(int fd, int fildes, off_t *offset, size_t len) {
+  char buf[CHUNK_SIZE];
+  ssize_t n;
+
+#ifdef __linux__
+  n = sendfile(fd, fildes, offset, MIN(len, MAX_SENDFILE));
+  if(n != -1 || (errno != EINVAL && errno != ENOSYS)) return n;
+#endif
+
+  if((n = pread(fildes, buf, MIN(len, CHUNK_SIZE), *offset)) <= 0) return n;
+  if((n = send(fd, buf, n, 0)) > 0) *offset += n;
+
+  return n;
+}
+
+/* Sends len bytes of the file open on fildes, starting at offset, to the
+   socket fd, however many goes it takes.
+   Returns 0 on success, or -1 on error or if the file ends too soon */
+int send_file_range(int fd, int fildes, off_t offset, off_t len) {
+  ssize_t n;
+
+  while(len > 0) {
+    if((n = send_file_part(fd, fildes, &offset, MIN(len, MAX_SENDFILE))) ==
+       -1) {
+      if(errno == EINTR) continue;
+      if((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd) == 0)
+        continue;
+      return -1;
+    }
+    if(n == 0) return -1;/* the file has been truncated underneath us */
+
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Sends everything that can be read from fildes, which can be a pipe or a
+   socket, to the blocking socket fd, until it ends. On Linux it's spliced
+   through a pipe, so that it doesn't have to be copied in and out of
+   userspace, unless fildes can't be spliced.
+   Returns 0 on success, or -1 on error */
+int send_stream(int fd, int fildes) {
+  char buf[CHUNK_SIZE];
+  ssize_t n;
+#ifdef __linux__
+  int p[2], moved = 0;
+  ssize_t m;
+
+  if(pipe2(p, O_CLOEXEC) == 0) {
+    while((n = splice(fildes, NULL, p[1], NULL, CHUNK_SIZE, SPLICE_F_MOVE))) {
+      if(n == -1 && errno == EINTR) continue;
+      if(n == -1) break;
+      moved = 1;
+
+      for(; n > 0; n -= m) {
+        if((m = splice(p[0], NULL, fd, NULL, n, SPLICE_F_MOVE)) == -1) {
+          if(errno != EINTR) break;
+          m = 0;
+        }
+      }
+      if(n > 0) break;
+    }
+
+    close(p[0]);
+    close(p[1]);
+
+    /* fall back to copying if it couldn't be spliced in the first place */
+    if(n == 0) return 0;
+    if(moved || errno != EINVAL) return -1;
+  }
+#endif
+
+  while((n = read(fildes, buf, CHUNK_SIZE)) != 0) {
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    if(send_all(fd, buf, n) == -1) return -1;
+  }
+
+  return 0;
+}
+
+/* Sends the num pieces of iov to the blocking socket fd with one sendmsg(),
+   or more if it doesn't all fit at once, passing flags to it.
+   Returns 0 on success, or -1 on error */
+static int send_iov(int fd, struct iovec *iov, int num, int flags) {
+  struct msghdr msg;
+  ssize_t n;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = num;
+
+  while(msg.msg_iovlen > 0) {
+    if((n = sendmsg(fd, &msg, flags)) == -1) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+
+    /* skip whatever has been sent */
+    for(; msg.msg_iovlen > 0 && n >= msg.msg_iov->iov_len; msg.msg_iovlen--) {
+      n -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+    }
+    if(msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* Adds a new chunk to the end of the queue and returns it */
+static chunk *new_chunk(outqueue *q) {
+  chunk *c = calloc(1, sizeof(chunk));
+
+  c->fildes = -1;
+
+  if(q->tail) q->tail->next = c;
+  else q->head = c;
+  q->tail = c;
+
+  return c;
+}
+
+/* Adds a copy of len bytes of buf to the end of the queue */
+void queue_data(outqueue *q, const void *buf, size_t len) {
+  chunk *c = q->tail;
+
+  /* start a new chunk unless there's room at the end of the last one */
+  if(!c || c->fildes != -1 || c->len + len > c->size) {
+    c = new_chunk(q);
+    c->size = MAX(len, CHUNK_SIZE);
+    c->data = malloc(c->size);
+  }
+
+  memcpy(c->data + c->len, buf, len);
+  c->len += len;
+}
+
+/* Adds len bytes of the file open on fildes, starting at offset, to the end of
+   the queue. fildes is closed once it has been sent */
+void queue_file(outqueue *q, int fildes, off_t offset, size_t len) {
+  char buf[SMALL_FILE_SIZE];
+  chunk *c;
+
+  /* a small file is copied in, so that it can go out in the same writev() as
+     the headers and whatever else is queued */
+  if(len <= SMALL_FILE_SIZE && pread(fildes, buf, len, offset) == len) {
+    queue_data(q, buf, len);
+    len = 0;
+  }
+
+  if(len == 0) {
+    close(fildes);
+    return;
+  }
+
+  c = new_chunk(q);
+
+  c->fildes = fildes;
+  c->offset = offset;
+  c->len = len;
+}
+
+/* Removes the chunk at the front of the queue */
+static void pop_chunk(outqueue *q) {
+  chunk *c = q->head;
 
-  /* enough space for the http stuff and a space, plus 3 digits, plus a space,
-     plus the text, plus the endline, plus the NUL */
-  buf = malloc(strlen(r->http) + 1 + 3 + 1 +
-               strlen(status_reason[r->status]) + 2 + 1);
-  len = sprintf(buf, "%s %d %s\r\n", r->http, r->status,
-                status_reason[r->status]);
+  q->head = c->next;
+  if(!q->head) q->tail = NULL;
 
-  send(r->fd, buf, len, 0);
+  if(c->fildes != -1) close(c->fildes);
+  free(c->data);
+  free(c);
+}
+
+/* Throws away everything in the queue */
+void free_queue(outqueue *q) {
+  while(q->head) pop_chunk(q);
+}
 
-  free(buf);
+/* Removes the first n bytes that have been sent from the queue */
+void consume_queue(outqueue *q, size_t n) {
+  chunk *c;
+
+  while((c = q->head) && n >= c->len - c->pos) {
+    n -= c->len - c->pos;
+    pop_chunk(q);
+  }
+  if(c) c->pos += n;
 }
 
-/* Sends the headers for the given request to the client. */
-void send_headers(request *r) {
-  char clength[decimal_length(unsigned long long) + 3];
+/* Sends as much of the queue to the non-blocking socket fd as possible.
+   Returns 1 if the queue has been emptied, 0 if fd would block, or -1 on
+   error */
+int flush_queue(outqueue *q, int fd) {
+  struct iovec iov[16];
+  chunk *c;
+  ssize_t n;
+  int i;
+
+  while((c = q->head)) {
+    if(c->fildes == -1) {
+      /* send as many chunks of data as we can in one go */
+      for(i = 0; c && c->fildes == -1 && i < 16; c = c->next, i++) {
+        iov[i].iov_base = c->data + c->pos;
+        iov[i].iov_len = c->len - c->pos;
+      }
+      n = writev(fd, iov, i);
+    } else {
+      n = send_file_part(fd, c->fildes, &c->offset, c->len - c->pos);
+      /* the file has been truncated underneath us */
+      if(n == 0) return -1;
+    }
 
-  send_response(r);
+    if(n == -1) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
+    }
 
-  send_str(r->fd, "Server: " SERVER "\r\n");
+    /* now remove whatever was sent from the queue */
+    consume_queue(q, n);
+  }
+
+  return 1;
+}
 
-  send_str(r->fd, "Connection: ");
-  send_str(r->fd, r->close_conn ? "close" : "keep-alive");
-  send_str(r->fd, "\r\n");
+/* Adds the string str to the end of the *len bytes at *buf, which must be the
+   last thing allocated from a */
+static void add_str(arena *a, char **buf, size_t *len, const char *str) {
+  size_t n = strlen(str);
+
+  *buf = arena_grow(a, *buf, *len, *len + n);
+  memcpy(*buf + *len, str, n);
+  *len += n;
+}
+
+/* Puts the status line and headers for the given request in *buf, in memory
+   from its arena, along with the headers in h that haven't been sent (see
+   fill_headers()) if h isn't NULL, and the blank line that ends them.
+   Returns their length */
+static size_t build_headers(request *r, headers *h, char *sent, char **buf) {
+  char num[decimal_length(unsigned long long) + 3];
+  arena *a = r->arena;
+  size_t len = 0;
+  int i;
+
+  *buf = NULL;
+
+  add_str(a, buf, &len, r->http);
+  sprintf(num, " %d ", r->status);
+  add_str(a, buf, &len, num);
+  add_str(a, buf, &len, status_reason[r->status]);
+  add_str(a, buf, &len, "\r\n");
+
+  add_str(a, buf, &len, "Server: " SERVER "\r\n");
+
+  add_str(a, buf, &len, r->close_conn ? "Connection: close\r\n"
+                                      : "Connection: keep-alive\r\n");
 
   if(r->date) {
-    send_str(r->fd, "Date: ");
-    send_str(r->fd, r->date);
-    send_str(r->fd, "\r\n");
+    add_str(a, buf, &len, "Date: ");
+    add_str(a, buf, &len, r->date);
+    add_str(a, buf, &len, "\r\n");
   }
 
   if(r->location) {/* it's a redirect */
-    send_str(r->fd, "Location: ");
+    add_str(a, buf, &len, "Location: ");
     if(r->location[0] == '/') {/* absolute URI required */
-      send_str(r->fd, "http://");
-      send_str(r->fd, r->host);
+      add_str(a, buf, &len, "http://");
+      add_str(a, buf, &len, r->host);
     }
-    send_str(r->fd, r->location);
-    send_str(r->fd, "\r\n");
+    add_str(a, buf, &len, r->location);
+    add_str(a, buf, &len, "\r\n");
   } else {
     if(r->status == 401) {
-      send_str(r->fd, "WWW-Authenticate: Basic realm=\"");
-      send_str(r->fd, r->auth_realm ? r->auth_realm : "default");
-      send_str(r->fd, "\"\r\n");
+      add_str(a, buf, &len, "WWW-Authenticate: Basic realm=\"");
+      add_str(a, buf, &len, r->auth_realm ? r->auth_realm : "default");
+      add_str(a, buf, &len, "\"\r\n");
+    }
+
+    if((r->status == 200 || r->status == 206) && r->last_modified) {
+      add_str(a, buf, &len, "Last-Modified: ");
+      add_str(a, buf, &len, r->last_modified);
+      add_str(a, buf, &len, "\r\n");
+    }
+
+    if((r->status == 200 || r->status == 206) && r->accept_ranges)
+      add_str(a, buf, &len, "Accept-Ranges: bytes\r\n");
+
+    /* a compressed copy is a different set of bytes, so it gets a tag of its
+       own */
+    if((r->status == 200 || r->status == 206 || r->status == 304) &&
+       r->etag) {
+      add_str(a, buf, &len, "ETag: \"");
+      add_str(a, buf, &len, r->etag);
+      if(r->encoding != IDENTITY) {
+        add_str(a, buf, &len, "-");
+        add_str(a, buf, &len, encoding_name[r->encoding]);
+      }
+      add_str(a, buf, &len, "\"\r\n");
     }
 
-    if(r->status == 200 && r->last_modified) {
-      send_str(r->fd, "Last-Modified: ");
-      send_str(r->fd, r->last_modified);
-      send_str(r->fd, "\r\n");
+    if(r->content_range) {
+      add_str(a, buf, &len, "Content-Range: ");
+      add_str(a, buf, &len, r->content_range);
+      add_str(a, buf, &len, "\r\n");
     }
   }
-	
-  send_str(r->fd, "Content-Type: ");
-  send_str(r->fd, r->content_type);
-  send_str(r->fd, "\r\n");
+
+  add_str(a, buf, &len, "Content-Type: ");
+  add_str(a, buf, &len, r->content_type);
+  add_str(a, buf, &len, "\r\n");
 
   if(r->meth != HEAD || r->content_length != 0) {
-    send_str(r->fd, "Content-Length: ");
-    sprintf(clength, "%llu\r\n", r->content_length);
-    send_str(r->fd, clength);
+    add_str(a, buf, &len, "Content-Length: ");
+    sprintf(num, "%llu\r\n", r->content_length);
+    add_str(a, buf, &len, num);
   }
 
   if(r->encoding != IDENTITY) {
-    send_str(r->fd, "Content-Encoding: ");
-    send_str(r->fd, encoding_name[r->encoding]);
-    send_str(r->fd, "\r\n");
+    add_str(a, buf, &len, "Content-Encoding: ");
+    add_str(a, buf, &len, encoding_name[r->encoding]);
+    add_str(a, buf, &len, "\r\n");
+  }
+
+  /* so that caches don't give a compressed copy to a client that can't take
+     it, or the other way round */
+  if(r->vary && (r->status == 200 || r->status == 206 || r->status == 304))
+    add_str(a, buf, &len, "Vary: Accept-Encoding\r\n");
+
+  /* extra headers from a CGI script */
+  for(i = 0; h && i < h->num; i++) {
+    if(sent[i]) continue;
+
+    add_str(a, buf, &len, h->list[i].name);
+    add_str(a, buf, &len, ": ");
+    add_str(a, buf, &len, h->list[i].value);
+    add_str(a, buf, &len, "\r\n");
+    sent[i] = 1;
+  }
+
+  add_str(a, buf, &len, "\r\n");
+
+  return len;
+}
+
+/* Sends the headers for the given request to the client, followed by the
+   first len bytes of the body from body (which can be NULL if len is 0), all
+   in one go. h and sent are extra headers from a CGI script, as given to
+   fill_headers(), or NULL. If more is non-zero, the rest of the body is about
+   to follow, so the kernel is asked to hold back a part-filled packet for
+   it */
+void send_headers(request *r, headers *h, char *sent, const void *body,
+                  size_t len, int more) {
+  struct iovec iov[2];
+  char *buf;
+  size_t n = build_headers(r, h, sent, &buf);
+
+  if(r->conn) {/* the event loop sends it all in one writev() anyway */
+    queue_data(&r->conn->out, buf, n);
+    if(len) queue_data(&r->conn->out, body, len);
+    return;
+  }
+
+  iov[0].iov_base = buf;
+  iov[0].iov_len = n;
+  iov[1].iov_base = (void*)body;
+  iov[1].iov_len = len;
+
+  send_iov(r->fd, iov, len ? 2 : 1, more ? MSG_MORE : 0);
+}
+
+/* Sends the len bytes at buf to the client of the given request, after
+   whatever has been sent already, or queues them for its event loop. If more
+   is non-zero, more of the response is about to follow.
+   Returns 0 on success, or -1 on error */
+int send_bytes(request *r, const void *buf, size_t len, int more) {
+  struct iovec iov;
+
+  if(r->conn) {
+    queue_data(&r->conn->out, buf, len);
+    return 0;
   }
+
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
+
+  return send_iov(r->fd, &iov, 1, more ? MSG_MORE : 0);
+}
+
+/* Sends len bytes of the file for the given request, starting at offset, to
+   its client after whatever has been sent already, or queues them for its
+   event loop. They come from r->body if the file came from the shared cache,
+   and from fildes (which is left open) otherwise.
+   Returns 0 on success, or -1 on error */
+int send_part(request *r, int fildes, off_t offset, off_t len) {
+  if(r->body) return send_bytes(r, r->body + offset, len, 0);
+
+  if(r->conn) {
+    if((fildes = fcntl(fildes, F_DUPFD_CLOEXEC, 0)) == -1) return -1;
+    queue_file(&r->conn->out, fildes, offset, len);
+    return 0;
+  }
+
+  return send_file_range(r->fd, fildes, offset, len);
 }
 
-/* sends the file with the given name to the socket; returns 0 on success and
-   -1 on error; if USE_SENDFILE is defined, len must be the length to send,
-   otherwise it is unused. Sending always starts at the start of the file */
-int send_file_to_socket(const char *filename, int fd, size_t len) {
-  char buf[1024];
+/* Returns a descriptor for the file of the given request, which is the
+   caller's to close: the one that file_stuff() opened, if it's for this file,
+   or a new one.
+   Returns -1 on error */
+int open_file(request *r) {
   int fildes;
 
-  if((fildes = open(filename, O_RDONLY)) == -1) return -1;
+  if(r->fildes != -1 && strcmp(r->stat_file, r->file) == 0) {
+    fildes = r->fildes;
+    r->fildes = -1;
+    return fildes;
+  }
 
-  /* Note the unterminated if statement in the preprocessor macro */
-#ifdef USE_SENDFILE
-  /* we are using sendfile */
-  if(sendfile(fd, fildes, NULL, len) == -1)
-#endif
-    /* sendfile failed or isn't used, fall back to manual sending */
-    do {
-      while((len = read(fildes, buf, 1024)) > 0)
-        send(fd, buf, len, 0);
-    } while(len == -1 && errno == EINTR);
+  return open(r->file, O_RDONLY | O_CLOEXEC);
+}
+
+/* Sends the file for the given request to the blocking socket, along with its
+   headers; a small file goes in the same packet as them. The file is read at
+   given offsets, since its descriptor may share its position with the file
+   cache's (see filecache.c).
+   Returns 0 on success and -1 on error */
+int send_file_to_socket(request *r) {
+  char buf[SMALL_FILE_SIZE];
+  off_t len = r->content_length;
+  int fildes, ret;
+
+  /* the headers would promise a body that never comes */
+  if((fildes = open_file(r)) == -1) {
+    log_text(err, "Unable to open %s for reading.", r->file);
+    r->status = 500;
+    send_errorpage(r);
+    return -1;
+  }
+
+  if(len <= SMALL_FILE_SIZE && pread(fildes, buf, len, 0) == len) {
+    send_headers(r, NULL, NULL, buf, len, 0);
+    close(fildes);
+    return 0;
+  }
+
+  send_headers(r, NULL, NULL, NULL, 0, 1);
+
+  /* the client can't tell where the response ends if it's cut short */
+  if((ret = send_file_range(r->fd, fildes, 0, len)) == -1) r->close_conn = 1;
 
   close(fildes);
 
-  return 0;
+  return ret;
 }
 
 /* Sends the builtin file to the client */
 void send_builtin(request *r) {
   r->encoding = IDENTITY;
-  send_headers(r);
-  send_str(r->fd, "\r\n");
-  send(r->fd, r->img_data, r->content_length, 0);
+  send_headers(r, NULL, NULL, r->img_data,
+               r->meth != HEAD ? r->content_length : 0, 0);
+}
+
+/* Gives the file of the given request an entity tag, which changes whenever
+   the file is replaced, changes size, or is written to */
+static void make_etag(request *r) {
+  unsigned long long mtime = (unsigned long long)r->statbuf.st_mtime *
+    1000000000;
+
+#ifdef __linux__
+  mtime += r->statbuf.st_mtim.tv_nsec;
+#endif
+
+  r->etag = arena_alloc(r->arena, 3 * decimal_length(unsigned long long));
+  sprintf(r->etag, "%llx-%llx-%llx", (unsigned long long)r->statbuf.st_ino,
+          (unsigned long long)r->statbuf.st_size, mtime);
+}
+
+/* Returns 1 if the list of entity tags from an If-None-Match header has the
+   tag of the response to the given request in it (or is "*"), or 0 if not.
+   Weak tags count too, since all the client wants is a copy that's as good
+   as the one it has */
+static int etag_listed(request *r, const char *list) {
+  const char *suffix = encoding_name[r->encoding];
+  size_t len = strlen(r->etag);
+  const char *p, *end;
+  size_t n;
+
+  for(p = list; *p; p = end + 1) {
+    if(*p == ' ' || *p == '\t' || *p == ',') {
+      end = p;
+      continue;
+    }
+    if(*p == '*') return 1;
+
+    if(strncmp(p, "W/", 2) == 0) p += 2;
+    if(*p != '"' || !(end = strchr(p + 1, '"'))) return 0;
+    p++;
+    n = end - p;
+
+    /* a compressed copy's tag has its encoding on the end, and only matches
+       if that's what would be sent */
+    if(n < len || strncmp(p, r->etag, len) != 0) continue;
+    if(r->encoding == IDENTITY ? n == len :
+       n == len + 1 + strlen(suffix) && p[len] == '-' &&
+       strncmp(p + len + 1, suffix, n - len - 1) == 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Tells the client that its copy of the file is still good, which takes no
+   more than the headers */
+static void send_not_modified(request *r) {
+  r->status = 304;
+  r->meth = HEAD;
+  r->content_length = 0;
+
+  send_headers(r, NULL, NULL, NULL, 0, 0);
 }
 
 /* Sends the file to the client */
 void send_file(request *r) {
-  int fd;
+  int fd, ahead;
 
   /* find out if we must make a dir listing */
   if(r->is_dir) {
@@ -142,36 +615,89 @@ void send_file(request *r) {
   }
 
   if(r->content_type[0] == '/') {
-    /* a path to a handler has been given, run the script */
+    /* a path to a handler has been given, run the script; an event loop can't
+       wait for it, so it gets a handler process instead */
+    if(r->conn && hand_off(r)) return;
     run_cgi(r);
     return;
   }
 
-  /* page not modified */
+  /* a copy that was compressed in advance is sent instead of the file if the
+     client can take it, unless only some of the file is wanted */
+  if(r->status == 200) {
+    r->vary = 1;
+    if(!r->range) use_precompressed(r);
+  }
+
+  /* the encoding has to be settled before tags can be compared; the file is
+     sent un-compressed if we're not using gzip, or if it's filename contains
+     ".gz" or it's too small to be worth it */
+  if(r->status == 200 && !r->precompressed &&
+     (r->encoding != GZIP || strstr(r->file, ".gz") ||
+      r->content_length < GZIP_BUF_SIZE))
+    r->encoding = IDENTITY;
+
+  /* page not modified; If-None-Match is used instead of If-Modified-Since if
+     both are given */
   if(r->status == 200) {
-    if(r->last_modified_t <= r->if_modified_since) {
-      r->status = 304;
-      r->meth = HEAD;
-      send_errorpage(r);
+    make_etag(r);
+    if(r->if_none_match ? etag_listed(r, r->if_none_match)
+                        : r->last_modified_t <= r->if_modified_since) {
+      send_not_modified(r);
       return;
     }
   }
 
-  /* now send the file un-compressed if we're not using gzip, or if it's
-     filename contains ".gz" */
-  if(r->encoding != GZIP || strstr(r->file, ".gz")) {
-    r->encoding = IDENTITY;
+  /* only some of it is wanted; it's sent uncompressed, so that the ranges
+     are of the file itself */
+  if(r->status == 200) {
+    r->accept_ranges = 1;
+    if(r->range && get_ranges(r) != -1) {
+      send_ranges(r);
+      return;
+    }
+  }
 
-    send_headers(r);
-    send_str(r->fd, "\r\n");
-    
-    send_file_to_socket(r->file, r->fd, r->content_length);
+  /* a file from the shared cache goes in one write with its headers */
+  if(r->body && r->encoding == IDENTITY) {
+    send_headers(r, NULL, NULL, r->body,
+                 r->meth != HEAD ? r->content_length : 0, 0);
+    return;
+  }
+
+  /* a copy that was compressed in advance is sent like any other file */
+  if(r->precompressed || r->encoding == IDENTITY) {
+    if(r->meth == HEAD) {
+      send_headers(r, NULL, NULL, NULL, 0, 0);
+    } else if(!r->conn) {
+      send_file_to_socket(r);
+    } else {/* the event loop sends the file */
+      ahead = r->read_ahead;
+      if((fd = open_file(r)) == -1) {
+        log_text(err, "Unable to open %s for reading.", r->file);
+        r->status = 500;
+        send_errorpage(r);
+        return;
+      }
+
+      /* if it's the file that the filesystem pool opened, the pool read the
+         start of it at the same time; open_file() leaves that one alone if it
+         opens another */
+      if(r->fildes != -1) ahead = 0;
+
+      send_headers(r, NULL, NULL, NULL, 0, 0);
+      queue_file(&r->conn->out, fd, 0, r->content_length);
+      if(ahead && r->conn->out.tail) r->conn->out.tail->ahead = READAHEAD_SIZE;
+    }
 
     return;
   }
 
+  /* gzipping blocks, so an event loop hands it to a handler process */
+  if(r->conn && hand_off(r)) return;
+
   /* gzip and send it */
-  fd = open(r->file, O_RDONLY);
+  fd = open(r->file, O_RDONLY | O_CLOEXEC);
   if(fd == -1) {
     r->status = 500;
     
@@ -181,5 +707,5 @@ void send_file(request *r) {
     return;
   }
  
-  send_gzipped(r, fd, MMAPABLE, r->content_length, NULL, 0, NULL);
+  send_gzipped(r, fd, MMAPABLE, r->content_length, NULL, NULL);
 }
@@ -12,6 +12,17 @@ int daemonize = 0;
 char *user, *group;
 char *server_name = "localhost";
 char *listen_addr = NULL;
+int workers = 0;
+int engine = ENGINE_FORK;
+int reuseport = 0;
+int affinity = -1;/* chosen in main() if it isn't given */
+int backlog = SOMAXCONN;
+int defer_accept = 0;
+int fastopen = 0;
+size_t max_request_line = MAXREQUESTLINE;
+size_t max_header_size = MAXHEADERSIZE;
+size_t shm_cache_size = SHM_CACHE_SIZE;
+size_t shm_file_size = SHM_FILE_SIZE;
 
 /* Makes a duplicate of the first n bytes of s. Will always copy n bytes and
    add a NUL-terminator regardless of the length of s */
@@ -25,21 +36,68 @@ char *strdup2(const char *s, size_t n) {
   return p;
 }
 
+/* Puts the name of the directory that path is in, with its slash, in dir,
+   which must have room for PATH_MAX bytes.
+   Returns 0 on success, or -1 if it's too long */
+int dir_name(const char *path, char *dir) {
+  const char *p = strrchr(path, '/');
+
+  if(!p) {
+    strcpy(dir, ".");
+    return 0;
+  }
+
+  if(p + 1 - path >= PATH_MAX) return -1;
+  memcpy(dir, path, p + 1 - path);
+  dir[p + 1 - path] = '\0';
+
+  return 0;
+}
+
 void show_help(void) {
   printf(
          SERVER " by James Stanley.\n"
          "Light, config-less, HTTP server.\n"
          "\n"
+         "  -A POLICY  Place workers on CPUs according to POLICY, which is "
+         "\"none\", \"core\" (a CPU each), \"numa\" (a NUMA node each, in "
+         "turn, with memory from that node) or \"incoming\" (a CPU each, "
+         "taking the connections that arrive on that CPU; implies -R). The "
+         "default is \"core\" with -R, and \"none\" otherwise. Workers log "
+         "their stats on SIGUSR1\n"
+         "  -b NUM     Allow NUM connections to queue up waiting to be accepted "
+         "(default: SOMAXCONN)\n"
+         "  -c BYTES   Share a cache of up to BYTES of small files between all "
+         "processes, or 0 to not (default: 8388608)\n"
+         "  -C BYTES   Only put files of up to BYTES in the shared cache "
+         "(default: 16384)\n"
          "  -d         Daemonize\n"
+         "  -D SECS    Don't accept connections until the client has sent "
+         "something, or SECS seconds have passed (TCP_DEFER_ACCEPT)\n"
+         "  -E ENGINE  Handle connections with ENGINE, which is \"fork\" (a "
+         "process per connection, the default), \"epoll\" (an event loop per "
+         "worker, with one worker per CPU unless -w is given) or \"uring\" "
+         "(like epoll, but using io_uring, falling back to epoll if the kernel "
+         "doesn't support it)\n"
+         "  -F NUM     Enable TCP Fast Open, with up to NUM pending requests\n"
          "  -g GROUP   After initialising, setgid to GROUP (see -u)\n"
          "  -h         Show this text\n"
+         "  -H BYTES   Refuse requests whose headers are longer than BYTES "
+         "(default: 32768)\n"
          "  -l ADDR    Listen on the given address\n"
+         "  -L BYTES   Refuse requests whose request line is longer than BYTES "
+         "(default: 8192)\n"
          "  -m FILE    Prefer MIME types from the given file (also loads definitions "
          "from the default files). There can be several of this option.\n"
          "  -p PORT    Listen on the given port\n"
          "  -P PIDFILE Write the PID to the given file\n"
+         "  -R         Give each worker its own SO_REUSEPORT listening socket and "
+         "(unless -A says otherwise) its own CPU, with one worker per CPU unless -w "
+         "is given\n"
          "  -s HOSTNAME Name to use as host name in HTTP 1.0 requests\n"
          "  -u USER    After initialising, setuid to USER (see -g)\n"
+         "  -w NUM     Pre-fork NUM worker processes which are each re-used "
+         "for many connections, instead of forking once per connection\n"
          "\n"
          "Defaults are:\n"
          " -p8080 -slocalhost\n"
@@ -50,23 +108,12 @@ void show_help(void) {
          );
 }
 
-/* Thanks Beej :) */
-void *get_in_addr(struct sockaddr *sa) {
-  if(sa->sa_family == AF_INET) {
-    return &(((struct sockaddr_in*)sa)->sin_addr);
-  }
-
-  return &(((struct sockaddr_in6*)sa)->sin6_addr);
-}
-
-
 int main(int argc, char **argv) {
-  struct sockaddr_storage clientaddr;
   char addr[INET6_ADDRSTRLEN];
-  char *ptr;
-  socklen_t size;
   int servfd, fd;
-  int n, opt;
+  int *listeners = NULL;
+  int *inherited;
+  int n, opt, ninherited = 0;
   struct passwd *pw;
   struct group *gr;
 
@@ -78,24 +125,75 @@ int main(int argc, char **argv) {
 
   load_mimetypes();
   init_builtin_files();
+  init_scan();
+  init_file_cache();
+  init_upgrade(argv);
 
   /* get command line options */
   opterr = 1;
-  while((opt = getopt(argc, argv, "dg:hl:m:p:P:s:u:")) != -1) {
+  while((opt = getopt(argc, argv, "A:b:c:C:dD:E:F:g:hH:l:L:m:p:P:Rs:u:w:")) != -1) {
     switch(opt) {
+    case 'A':
+      if((affinity = affinity_policy(optarg)) == -1) {
+        log_text(err, "Unknown affinity policy '%s', exiting.", optarg);
+        return 1;
+      }
+      break;
+    case 'b':
+      backlog = atoi(optarg);
+      if(backlog < 1) {
+        log_text(err, "Backlog must be at least 1, exiting.");
+        return 1;
+      }
+      break;
+    case 'c':
+      shm_cache_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      shm_file_size = strtoul(optarg, NULL, 10);
+      break;
     case 'd':
       daemonize = 1;
       if(!pidfile) pidfile = "/var/run/serve.pid";
       break;
+    case 'D':
+      defer_accept = atoi(optarg);
+      break;
+    case 'E':
+      if(strcmp(optarg, "fork") == 0) engine = ENGINE_FORK;
+      else if(strcmp(optarg, "epoll") == 0) engine = ENGINE_EPOLL;
+      else if(strcmp(optarg, "uring") == 0) engine = ENGINE_URING;
+      else {
+        log_text(err, "Unknown engine '%s', exiting.", optarg);
+        return 1;
+      }
+      break;
+    case 'F':
+      fastopen = atoi(optarg);
+      break;
     case 'g':
       group = optarg;
       break;
     case 'h':
       show_help();
       return 0;
+    case 'H':
+      if(atoi(optarg) < 2) {
+        log_text(err, "Maximum header size must be at least 2, exiting.");
+        return 1;
+      }
+      max_header_size = atoi(optarg);
+      break;
     case 'l':
       listen_addr = optarg;
       break;
+    case 'L':
+      if(atoi(optarg) < 16) {
+        log_text(err, "Maximum request line must be at least 16, exiting.");
+        return 1;
+      }
+      max_request_line = atoi(optarg);
+      break;
     case 'm':
       load_mimetypes_from(optarg);
       break;
@@ -105,22 +203,59 @@ int main(int argc, char **argv) {
     case 'P':
       pidfile = optarg;
       break;
+    case 'R':
+      reuseport = 1;
+      break;
     case 's':
       server_name = optarg;
       break;
     case 'u':
       user = optarg;
       break;
+    case 'w':
+      workers = atoi(optarg);
+      if(workers < 1) {
+        log_text(err, "Number of workers must be at least 1, exiting.");
+        return 1;
+      }
+      break;
     default:
       log_text(err, "Bad argument passed, exiting.");
       return 1;
     }
   }
 
-  /* initialise server */
-  servfd = init_net(port);
+  /* a worker can only ask for the connections arriving on its CPU if it has a
+     socket of its own, and a worker with its own socket gets its own CPU unless
+     we're told otherwise */
+  if(affinity == AFFINITY_INCOMING) reuseport = 1;
+  if(affinity == -1) affinity = reuseport ? AFFINITY_CORE : AFFINITY_NONE;
+
+  /* event loops and SO_REUSEPORT sockets always run in workers, one per CPU
+     by default */
+  if((engine != ENGINE_FORK || reuseport) && !workers)
+    workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+  /* initialise server; with SO_REUSEPORT every worker gets its own socket,
+     which we open now in case we won't have permission to after setuid. If
+     we're replacing an old server, we use its sockets instead */
+  if((inherited = inherited_sockets(&ninherited))) servfd = inherited[0];
+  else servfd = init_net(port, reuseport);
+  if(workers) {
+    listeners = malloc(workers * sizeof(int));
+    for(n = 0; n < workers; n++) {
+      if(!reuseport || !n) listeners[n] = servfd;
+      else if(n < ninherited) listeners[n] = inherited[n];
+      else listeners[n] = init_net(port, 1);
+    }
+  }
+  for(n = (workers && reuseport) ? workers : 1; n < ninherited; n++)
+    close(inherited[n]);
   init_sighandlers();
   init_status_reason();
+  init_shm_cache();
+
+  log_text(out, "Scanning requests %s.", scanner_name);
 
   /* now let's daemonize */
   if(daemonize) {
@@ -176,18 +311,18 @@ int main(int argc, char **argv) {
 
   /* set up a process group to avoid zombified processes */
   setpgid(0, 0);
+
+  /* the old server can leave the rest to us now */
+  upgrade_ready();
 	
+  /* let long-lived workers accept connections themselves */
+  if(workers) run_workers(listeners, workers);
+
   /* accept and handle connections forever */
   while(1) {
-    size = sizeof(struct sockaddr_storage);
-
-    fd = accept(servfd, (struct sockaddr*)&clientaddr, &size);
+    if(upgrading && upgrade(&servfd, 1) == 0) retire(&servfd, 1);
 
-    if(fd == -1) {
-      if(errno != EINTR)
-        log_text(err, "accept returned -1 and it wasn't EINTR.");
-      continue;
-    }
+    if((fd = accept_client(servfd, addr, 0)) == -1) continue;
 
     /* flush output streams so they don't get flushed once for the parent and
        once for the child... */
@@ -210,17 +345,15 @@ int main(int argc, char **argv) {
 
     /* child process doesn't need this */
     close(servfd);
-		
-    /* now get the textual IP address */
-    inet_ntop(clientaddr.ss_family, get_in_addr((struct sockaddr*)&clientaddr),
-              addr, INET6_ADDRSTRLEN);
-    ptr = addr;
-
-    /* HACK: get nice-looking IPv4 addresses even if we're on IPv6 */
-    if(strncmp(ptr, "::ffff:", 7) == 0) ptr += 7;
-	 
+
     /* and handle the request */
-    handle(fd, ptr);
+    handle(fd, addr);
+
+    /* to prevent valgrind from complaining, we could free the mime types here
+       and also close libmagic's cookie;
+       we won't do this though, as that would cause copy-on-write of the mime
+       types, which is a waste of time seeing as we're leaving now anyway */
+    exit(0);
   }
 
   return 0;
@@ -3,7 +3,11 @@
 #ifndef SERVE_H_INC
 #define SERVE_H_INC
 
-/* for strptime */
+/* for sched_setaffinity and friends on Linux */
+#define _GNU_SOURCE
+
+/* for the POSIX.1-2001 functions (pread, gmtime_r, mkstemp...) where there's
+   no _GNU_SOURCE, and strptime for the old get_date() in bench/date.c */
 #define _XOPEN_SOURCE 600
 
 /* for scandir */
@@ -16,8 +20,10 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/param.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +39,11 @@
 #include <pwd.h>
 #include <grp.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
+
 #ifdef __FreeBSD__
 #define __BSD_VISIBLE 1
 #include <sys/dirent.h>
@@ -50,10 +61,6 @@
 #include <magic.h>
 #endif
 
-#ifdef USE_SENDFILE
-#include <sys/sendfile.h>
-#endif
-
 #ifdef USE_GZIP
 #include <zlib.h>
 #endif
@@ -75,12 +82,82 @@
 /* Maximum size of POST data before it is stored in a file instead of memory */
 #define MAXPOSTSIZE 65536
 
+/* Maximum size of POST data that is accepted at all; bigger gets a 413 */
+#define MAXPOSTLENGTH 16777216
+
 /* Maximum amount of time in seconds to keep persitent connections alive for */
 #define MAXKEEPALIVE 600
 
 /* Minimum size file to send gzip'd, also the size allocated for gzip buffer */
 #define GZIP_BUF_SIZE 16384
 
+/* Default size of the cache of small files that all processes share, and the
+   biggest file that goes in it (see -c and -C) */
+#define SHM_CACHE_SIZE 8388608
+#define SHM_FILE_SIZE 16384
+
+/* Number of slots in the shared cache that a file can go in (see
+   shmcache.c) */
+#define SHM_CACHE_WAYS 4
+
+/* Time in seconds that the event loop gives a client to send the whole of a
+   request, from when it's accepted or from the first byte of the request */
+#define HEADER_TIMEOUT 60
+
+/* Time in seconds that the event loop waits for a client to take any more of
+   a response */
+#define SEND_TIMEOUT 60
+
+/* Default maximum sizes of the request line and of the block of headers after
+   it (see -L and -H) */
+#define MAXREQUESTLINE 8192
+#define MAXHEADERSIZE 32768
+
+/* Size of the reads that a handler process makes from its connection */
+#define READ_SIZE 4096
+
+/* Maximum number of ranges that a Range header can ask for before it's
+   ignored and the whole file is sent */
+#define MAX_RANGES 32
+
+/* Maximum number of responses to pipelined requests that the event loop
+   queues up before sending them */
+#define MAXPIPELINE 32
+
+/* Number of headers that a request has room for before its list of them has
+   to go on the heap */
+#define INLINE_HEADERS 32
+
+/* Size of the blocks that requests' memory comes from (see arena.c), and the
+   most that a process keeps for later */
+#define ARENA_SIZE 8192
+#define MAX_SPARE_BLOCKS 64
+
+/* Room for a date as it goes in a header or at the start of a log line (see
+   clock.c), whatever the year */
+#define HTTP_DATE_SIZE 64
+#define LOG_DATE_SIZE  64
+
+/* Size of the pieces that responses are queued in by the event loop */
+#define CHUNK_SIZE 16384
+
+/* Files up to this size are copied in to the event loop's queue instead of
+   being sent from the file */
+#define SMALL_FILE_SIZE 4096
+
+/* Number of files each process keeps open in its file cache (see
+   filecache.c) */
+#define FILE_CACHE_SIZE 64
+
+/* Number of threads each event loop has for filesystem work */
+#define FS_THREADS 4
+
+/* How far ahead of a file being sent the filesystem threads read it */
+#define READAHEAD_SIZE 1048576
+
+/* Maximum time in seconds to wait for a new server to start when upgrading */
+#define UPGRADE_TIMEOUT 30
+
 /* Initial length for environment arrays for CGI scripts */
 #define INIT_ENV_LENGTH 64
 
@@ -93,10 +170,24 @@
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
+#ifndef MAX
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#endif
+
 extern char *port;
 extern char *pidfile;
 extern char *server_name;
 extern char *listen_addr;
+extern int engine;
+extern int reuseport;
+extern int affinity;
+extern int backlog;
+extern int defer_accept;
+extern int fastopen;
+extern size_t max_request_line;
+extern size_t max_header_size;
+extern size_t shm_cache_size;
+extern size_t shm_file_size;
 
 /* so that we can state Main process or Handler process when we are killed */
 unsigned char is_handler;
@@ -104,9 +195,81 @@ unsigned char is_handler;
 #define DISK   0
 #define MEMORY 1
 
-typedef struct header_s header;
+typedef struct connection_s connection;
+typedef struct arena_block_s arena_block;
+
+typedef struct arena_s {
+  arena_block *block;/* the block that memory is coming from */
+  void *top;/* the last thing allocated from it, which can grow */
+} arena;
+
+/* the headers that serve knows about, which are recognised once as they're
+   parsed (see header_id()) */
+#define HEADER_UNKNOWN           -1
+#define HEADER_HOST               0
+#define HEADER_CONNECTION         1
+#define HEADER_KEEP_ALIVE         2
+#define HEADER_IF_MODIFIED_SINCE  3
+#define HEADER_ACCEPT_ENCODING    4
+#define HEADER_CONTENT_ENCODING   5
+#define HEADER_USER_AGENT         6
+#define HEADER_CONTENT_LENGTH     7
+#define HEADER_CONTENT_TYPE       8
+#define HEADER_AUTHORIZATION      9
+#define HEADER_DATE              10
+#define HEADER_LAST_MODIFIED     11
+#define HEADER_STATUS            12
+#define HEADER_LOCATION          13
+#define HEADER_SERVER            14
+#define HEADER_RANGE             15
+#define HEADER_IF_RANGE          16
+#define HEADER_IF_NONE_MATCH     17
+#define HEADERS                  18
+
+/* a header is a slice of the block of header lines that it arrived in, which
+   has a NUL put after the name and after the value so that they can be used
+   as strings */
+typedef struct header_s {
+  char *name;
+  size_t name_len;
+  char *value;
+  size_t value_len;
+  int id;/* one of the above */
+} header;
+
+typedef struct headers_s {
+  header *list;/* the inline list, unless there were too many for it */
+  int num;
+  int size;/* the number of headers that list has room for */
+  char *known[HEADERS];/* the value of the last of each known header, or NULL */
+  header inline_list[INLINE_HEADERS];
+} headers;
+
+/* content codings (see compression.c) */
+#define IDENTITY 0
+#define GZIP     1
+#define BROTLI   2
+#define ZSTD     3
+#define ENCODINGS 4
+
+#define ENCODING(e) (1 << (e)) /* for sets of encodings */
+
+/* the copies of a file that were compressed in advance (see find_copies());
+   fildes is -1 for an encoding that there isn't a copy in */
+typedef struct compressed_copies_s {
+  int known;/* if they've been looked for yet */
+  int fildes[ENCODINGS];
+  struct stat statbuf[ENCODINGS];
+} compressed_copies;
+
+/* a part of a file that a client asked for with a Range header */
+typedef struct byte_range_s {
+  off_t start;
+  off_t len;
+} byte_range;
 
 typedef struct request_s {
+  arena *arena;/* everything below belongs to this */
   int fd;
   char *user_agent;
   char *client;
@@ -122,8 +285,7 @@ typedef struct request_s {
   char *date;
   int status;
   int is_dir;
-  header *header_list;
-  int num_headers;
+  headers headers;
   char *post_file;
   char *post_data;
   size_t post_length;
@@ -134,18 +296,100 @@ typedef struct request_s {
   int close_conn;
   char *location;
   time_t if_modified_since;
+  char *if_none_match;
+  char *etag;/* the file's entity tag, without the quotes */
   char *host;
   unsigned char *img_data;
+  char *body;/* the file's contents, if they came from the shared cache */
+  char *range;/* the Range header, if it's to be looked at */
+  char *if_range;
+  byte_range *ranges;/* the parts of the file that it asked for */
+  int num_ranges;
+  char *content_range;/* for a Content-Range header */
+  int accept_ranges;/* if the response should say that ranges are allowed */
+  int accept_encodings;/* a set of ENCODING() bits */
   int encoding;
+  int precompressed;/* if file is a copy that was compressed in advance */
+  compressed_copies copies;/* of the file, which are the request's to close */
+  int vary;/* if the response depends on Accept-Encoding */
+  connection *conn;/* if non-NULL, the response is queued for an event loop */
+  char *stat_file;/* the file that statbuf (and fildes, if not -1) are for */
+  struct stat statbuf;
+  int fildes;
+  int read_ahead;/* if the filesystem pool read the start of fildes */
 } request;
 
 char *strdup2(const char *s, size_t n);
+int dir_name(const char *path, char *dir);
+
+/* arena.c */
+arena *new_arena(void);
+void free_arena(arena *a);
+void *arena_alloc(arena *a, size_t n);
+void *arena_grow(arena *a, void *p, size_t old, size_t n);
+char *arena_strndup(arena *a, const char *s, size_t n);
+char *arena_strdup(arena *a, const char *s);
+
+/* clock.c */
+void http_date(time_t t, char *buf);
+const char *http_now(void);
+const char *log_now(void);
+time_t get_date(const char *str);
+
+/* filecache.c */
+void init_file_cache(void);
+int file_cached(const char *path);
+const struct stat *cached_stat(const char *path);
+int use_cached_file(request *r);
+void cache_file(request *r);
+
+/* shmcache.c */
+void init_shm_cache(void);
+int shm_file_cached(const char *path);
+void shm_drop_file(const char *path);
+int use_shm_file(request *r);
+void shm_cache_file(request *r);
+
+/* worker.c */
+void *get_in_addr(struct sockaddr *sa);
+void client_address(struct sockaddr_storage *clientaddr, char *addr);
+int accept_client(int servfd, char *addr, int nonblocking);
+void worker_loop(int servfd);
+pid_t spawn_worker(int *servfd, int num, int i);
+void run_workers(int *servfd, int num);
+
+/* affinity.c */
+#define AFFINITY_NONE     0
+#define AFFINITY_CORE     1
+#define AFFINITY_NUMA     2
+#define AFFINITY_INCOMING 3
+#define AFFINITIES        4
+
+typedef struct stats_s {
+  unsigned long connections;
+  unsigned long local;/* connections that arrived on the CPU we were on */
+  unsigned long requests;
+  unsigned long timeouts;
+} stats;
+
+extern stats worker_stats;
+extern volatile sig_atomic_t stats_wanted;
+extern char *affinity_name[];
+
+int affinity_policy(const char *name);
+int pin_to_cpu(int cpu);
+void place_worker(int i, int servfd);
+void count_connection(int fd);
+void request_stats(int sig);
+void log_stats(void);
 
 /* init.c */
 extern char *status_reason[600];
 extern char *page_text[600];
 
-int init_net(const char *service);
+int init_net(const char *service, int reuse);
+void ghost_buster(int sig);
+void clean_quit(int sig);
 void init_sighandlers(void);
 void init_status_reason(void);
 
@@ -161,36 +405,187 @@ void init_status_reason(void);
 #define CONNECT 7
 #define METHODS 8
 
-#define TEXT 0
-#define HEX1 1
-#define HEX2 2
-
 #define ENC_NORMAL  0
 #define ENC_CHUNKED 1
 
 extern char *method[METHODS];
 
+void set_timeout(int fd, int seconds);
 void handle(int fd, const char *addr);
-void record_post_data(request *r);
-time_t get_date(const char *str);
+void check_headers(request *r);
+int record_post_data(request *r);
 
 /* nextline.c */
+void forget_input(void);
+void buffer_input(int fd);
+void unread(int fd, const char *buf, size_t len);
+ssize_t read_data(int fd, void *buf, size_t len);
+char *read_line(int fd, size_t max, size_t *len);
+char *read_headers(int fd, size_t max, size_t *len);
 char *nextline(int fd);
 
 /* send.c */
+
+/* a piece of a queued response; either len bytes of data, or len bytes of the
+   file open on fildes starting at offset. pos is how much has been sent */
+typedef struct chunk_s {
+  struct chunk_s *next;
+  char *data;
+  size_t size;
+  size_t len;
+  size_t pos;
+  int fildes;
+  off_t offset;
+  off_t ahead;/* how far the file has been read ahead */
+} chunk;
+
+typedef struct outqueue_s {
+  chunk *head;
+  chunk *tail;
+} outqueue;
+
 ssize_t send_str(int fd, const char *str);
-void send_response(request *r);
-void send_headers(request *r);
-int send_file_to_socket(const char *filename, int fd, size_t len);
+void queue_data(outqueue *q, const void *buf, size_t len);
+void queue_file(outqueue *q, int fildes, off_t offset, size_t len);
+void free_queue(outqueue *q);
+void consume_queue(outqueue *q, size_t n);
+int flush_queue(outqueue *q, int fd);
+void send_headers(request *r, headers *h, char *sent, const void *body,
+                  size_t len, int more);
+ssize_t send_file_part(int fd, int fildes, off_t *offset, size_t len);
+int send_file_range(int fd, int fildes, off_t offset, off_t len);
+int send_stream(int fd, int fildes);
+int send_bytes(request *r, const void *buf, size_t len, int more);
+int send_part(request *r, int fildes, off_t offset, off_t len);
+int open_file(request *r);
+int send_file_to_socket(request *r);
 void send_file(request *r);
 
+/* timer.c */
+typedef struct timer_s {
+  time_t when;
+  void (*fire)(struct timer_s *t);
+  void *data;
+  struct timer_s *prev;
+  struct timer_s *next;
+} timer;
+
+void timer_set(timer *t, time_t when);
+void timer_cancel(timer *t);
+void run_timers(time_t now);
+
+/* event.c */
+#define ENGINE_FORK  0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+
+#define CONN_REQUEST    0 /* waiting for the request line */
+#define CONN_HEADERS    1 /* waiting for the rest of the headers */
+#define CONN_RESPONSE   2 /* sending the response */
+#define CONN_HANDOFF    3 /* taken over by a handler process */
+#define CONN_FILESYSTEM 4 /* waiting for the filesystem pool */
+#define CONN_WAITING    5 /* waiting to send earlier responses before handing
+                             off to a handler process */
+
+struct connection_s {
+  int fd;
+  int state;
+  char addr[INET6_ADDRSTRLEN];
+  char *in;/* input that hasn't been dealt with yet */
+  size_t in_len;
+  size_t in_size;
+  request *r;
+  outqueue out;
+  struct fsjob_s *job;/* filesystem job we're waiting for */
+  timer timeout;
+  int requests;/* responses that have been sent */
+  int queued;/* pipelined responses queued since the queue was last empty */
+  unsigned int events;/* what epoll is waiting for */
+  /* for the io_uring engine */
+  int ops;/* operations in flight */
+  int reading;
+  int writing;
+  int closing;
+  struct iovec iov[16];
+  char *filebuf;/* file data that has been read but not sent */
+  size_t file_len;
+  size_t file_pos;
+  struct connection_s *prev;
+  struct connection_s *next;
+};
+
+int set_nonblocking(int fd, int nonblocking);
+int init_events(int servfd);
+connection *new_connection(int fd, const char *addr);
+void close_connection(connection *c);
+int grow_input(connection *c);
+void got_input(connection *c, size_t n);
+int hand_off(request *r);
+int response_sent(connection *c);
+int output_sent(connection *c);
+int process_input(connection *c);
+void finish_job(struct fsjob_s *job);
+void finish_jobs(void);
+void set_deadline(connection *c, int seconds);
+void drain_connections(void);
+void event_loop(int servfd);
+
+/* uring.c */
+int uring_send(connection *c);
+void uring_open(struct fsjob_s *job);
+void uring_close(void);
+void uring_loop(int servfd);
+
+/* fspool.c */
+#define FS_OPEN    0 /* stat() path, and open it (and find its compressed
+                        copies) if it's a regular file */
+#define FS_SCANDIR 1 /* read the directory at path and stat() its contents */
+#define FS_READ    2 /* read ahead len bytes of fildes from offset */
+#define FS_COPIES  3 /* look for compressed copies of the file at path, which
+                        has been stat()ed and opened already */
+
+typedef struct fsjob_s {
+  struct fsjob_s *prev;
+  struct fsjob_s *next;
+  int type;
+  char *path;
+  int fildes;
+  off_t offset;
+  size_t len;
+  struct stat statbuf;
+  compressed_copies copies;/* of a regular file that's been opened */
+  int result;/* 0 on success, -1 on error */
+  void *data;
+} fsjob;
+
+int fs_init(void);
+fsjob *fs_job(int type, const char *path, int fildes, off_t offset,
+              size_t len, void *data);
+void fs_submit(fsjob *job);
+fsjob *fs_done(void);
+void fs_free(fsjob *job);
+
+/* upgrade.c */
+extern volatile sig_atomic_t upgrading;
+extern volatile sig_atomic_t draining;
+extern volatile sig_atomic_t idle;
+
+void request_upgrade(int sig);
+void request_drain(int sig);
+void init_upgrade(char **argv);
+int *inherited_sockets(int *num);
+int taking_over(void);
+void upgrade_ready(void);
+int upgrade(int *servfd, int num);
+void retire(int *servfd, int num);
+
 /* genpage.c */
 /* void emergency_500(int fd, const char *reason); */
 
 /* TODO: Support file, line, and reason in proper 500 pages */
 #define emergency_500(f, r) send_emergency_500(f, __FILE__, __LINE__, r)
 
-void add_text(char **page, size_t *pagelen, char *fmt, ...);
+void add_text(arena *a, char **page, size_t *pagelen, char *fmt, ...);
 void send_dir(request *r);
 int nonhidden(const struct dirent *d);
 int dirsort(const struct dirent **a, const struct dirent **b);
@@ -239,34 +634,44 @@ void setup_env(char ***env, request *r);
 void run_cgi(request *r);
 void write_post_data(int fd, request *r);
 void exec_script(int *fildes, char * const *env, request *r);
-void send_new_headers(header *header_list, int num_headers, char *sent,
-                      int fd);
-char *fill_headers(request *r, header *header_list, int num_headers,
-                   char *done);
+char *fill_headers(request *r, headers *h, char *done);
+
+/* range.c */
+int get_ranges(request *r);
+void send_ranges(request *r);
 
 /* request.c */
 void free_request(request *r);
 void fix_request(request *r);
 void file_stuff(request *r);
-request *request_info(int fd, const char *addr, const char *req);
+request *parse_request(int fd, const char *addr, const char *line,
+                       size_t line_len);
+request *bare_request(int fd, const char *addr, int status);
+request *request_info(int fd, const char *addr, const char *line,
+                      size_t len);
 int iswhite(char c);
-int method_type(const char *buf);
-char *requ_file(const char *buf);
+int split_request(const char *req, const char **tok, size_t *len);
+int method_type(const char *buf, size_t len);
 int hex_to_digit(char c);
-char *filename(const char *buf);
+char *filename(arena *a, const char *buf);
 char *stripendl(char *buf);
-char *http_version(const char *buf);
 int forbidden(const char *file);
 
+/* scan.c */
+extern char *scanner_name;
+
+void init_scan(void);
+const char *scan(const char *p, const char *end, char a, char b);
+
 /* headers.c */
-struct header_s {
-  char *name;
-  char *value;
-};
+extern char *header_name[HEADERS];
 
-void add_header(header **list, int num, char *header, char *value);
-void free_headers(header *list, int num);
-int next_header(int fd, char **lin, header **list, int num, size_t *length);
+int header_id(const char *name, size_t len);
+header *add_header(headers *h, char *name, size_t name_len, char *value,
+                   size_t value_len);
+void free_headers(headers *h);
+size_t headers_length(const char *buf, size_t len);
+int parse_headers(headers *h, char *block, size_t len, size_t *length);
 
 /* auth.c */
 char *str2bin(const char *s);
@@ -288,16 +693,20 @@ void init_builtin_files(void);
 void builtin_file_stuff(request *r);
 
 /* compression.c */
-#define IDENTITY 0
-#define GZIP     1
-
 #define NOT_MMAPABLE 0
 #define MMAPABLE     1
 
 extern char *encoding_name[];
-
-int get_encoding(const char *accept_encoding);
+extern char *encoding_suffix[];
+
+int get_encodings(const char *accept_encoding);
+int get_encoding(int encodings);
+void no_copies(compressed_copies *copies);
+void close_copies(compressed_copies *copies);
+void find_copies(const char *path, const struct stat *statbuf,
+                 compressed_copies *copies);
+int use_precompressed(request *r);
 void send_gzipped(request *r, int fd, int mmapable, long long len,
-                  header *header_list, int num_headers, char *sent);
+                  headers *h, char *sent);
 
 #endif
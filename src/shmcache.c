@@ -0,0 +1,334 @@
+/* Shared file cache for serve
+
+   Small files are kept, along with their content type and what stat() said
+   about them, in memory that the main process maps before it starts any other
+   processes, so that every worker and handler process shares the same copy of
+   them and can send one with its headers in a single write.
+
+   The memory is split in to slots with room for the biggest file that can be
+   cached (see -C), so the cache never takes up more than the size it's given
+   (see -c). A file can only go in one of SHM_CACHE_WAYS slots, picked by the
+   hash of its path; when they're all full, one that hasn't been used since the
+   clock hand last passed it is replaced.
+
+   There are no locks. Each slot has a sequence number that's odd while it's
+   being written, and is changed again when the write is done, so a reader
+   copies what it wants out of a slot and then checks that the number is still
+   the same as when it started. A writer that finds a slot already being
+   written just doesn't bother caching its file.
+
+   A file is dropped as soon as it's found to have changed. Before it's sent,
+   it's checked against what this process's file cache (see filecache.c) says
+   about it, or against a stat() if that doesn't have it, which is still
+   cheaper than opening and reading it. Only files without compressed copies
+   are kept, so the directory that it's in is stat()ed as well in that case,
+   in case one has turned up in it since.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define SHM_PATH_SIZE 256
+#define SHM_TYPE_SIZE 128
+
+typedef struct {
+  unsigned int seq;/* odd while the slot is being written */
+  unsigned int used;/* set when the slot is read, cleared by the clock hand */
+  unsigned int hash;/* of the path, or 0 if the slot is empty */
+  struct stat statbuf;
+  struct stat dir_statbuf;/* of the directory it's in */
+  char path[SHM_PATH_SIZE];
+  char content_type[SHM_TYPE_SIZE];
+  size_t len;
+  char data[1];/* the rest of the slot */
+} shm_slot;
+
+/* where each set of slots' clock hand points */
+typedef struct {
+  unsigned int hand;
+} shm_set;
+
+static char *shm;/* NULL if there's no cache */
+static shm_set *sets;
+static size_t slot_size;
+static unsigned int num_sets;
+
+/* Returns the hash of path, which is never 0 */
+static unsigned int path_hash(const char *path) {
+  unsigned int hash = 2166136261u;
+
+  /* FNV-1a */
+  for(; *path; path++) hash = (hash ^ (unsigned char)*path) * 16777619u;
+
+  return hash ? hash : 1;
+}
+
+/* Returns the given slot of the given set */
+static shm_slot *get_slot(unsigned int set, int way) {
+  return (shm_slot*)(shm + ((size_t)set * SHM_CACHE_WAYS + way) * slot_size);
+}
+
+/* Maps the shared memory for the cache; it has to be called before any other
+   processes are started, so that they all share it */
+void init_shm_cache(void) {
+  size_t num_slots, sets_size;
+
+  slot_size = offsetof(shm_slot, data) + shm_file_size;
+  slot_size = (slot_size + 63) & ~(size_t)63;/* a cache line each */
+
+  if(!shm_cache_size || (num_slots = shm_cache_size / slot_size) <
+     SHM_CACHE_WAYS)
+    return;
+
+  num_sets = num_slots / SHM_CACHE_WAYS;
+  sets_size = (num_sets * sizeof(shm_set) + 63) & ~(size_t)63;
+
+  /* anonymous shared memory is zeroed, which is an empty cache */
+  shm = mmap(NULL, num_sets * SHM_CACHE_WAYS * slot_size + sets_size,
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shm == MAP_FAILED) {
+    log_text(err, "Unable to map shared file cache: %s", strerror(errno));
+    shm = NULL;
+    return;
+  }
+
+  sets = (shm_set*)(shm + num_sets * SHM_CACHE_WAYS * slot_size);
+
+  log_text(out, "Caching files of up to %lu bytes in %u shared slots.",
+           (unsigned long)shm_file_size, num_sets * SHM_CACHE_WAYS);
+}
+
+/* Starts writing to s.
+   Returns 0 on success, or -1 if something else is writing to it */
+static int lock_slot(shm_slot *s) {
+  unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+  if((seq & 1) || !__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED))
+    return -1;
+
+  /* nothing written from now on can be seen before the slot is odd */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Finishes writing to s */
+static void unlock_slot(shm_slot *s) {
+  __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Empties s, unless something else is writing to it already */
+static void drop_slot(shm_slot *s) {
+  if(lock_slot(s) == -1) return;
+
+  s->hash = 0;
+  unlock_slot(s);
+}
+
+/* Returns 1 if a and b are from stat()s of the same, unchanged file */
+static int same_file(const struct stat *a, const struct stat *b) {
+#ifdef __linux__
+  if(a->st_ctim.tv_nsec != b->st_ctim.tv_nsec) return 0;
+#endif
+
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_size == b->st_size && a->st_mtime == b->st_mtime &&
+    a->st_ctime == b->st_ctime;
+}
+
+/* Copies what s says stat() said about the given path and its directory to
+   st and dir_st and, unless r is NULL, the file itself and its content type in
+   to r.
+   Returns 1 on success, or 0 if s doesn't have the path in it or it changed
+   while being copied */
+static int read_slot(shm_slot *s, unsigned int hash, const char *path,
+                     request *r, struct stat *st, struct stat *dir_st) {
+  unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+  char content_type[SHM_TYPE_SIZE];
+  char *body = NULL;
+  size_t len = 0;
+  int match;
+
+  if((seq & 1) || s->hash != hash) return 0;
+
+  match = strncmp(s->path, path, SHM_PATH_SIZE) == 0;
+  *st = s->statbuf;
+  *dir_st = s->dir_statbuf;
+  if(match && r) {
+    /* the length could be anything if the slot is being written */
+    len = MIN(s->len, shm_file_size);
+    body = arena_alloc(r->arena, len + 1);
+    memcpy(body, s->data, len);
+    memcpy(content_type, s->content_type, SHM_TYPE_SIZE);
+  }
+
+  /* it's only what was in the slot if nothing wrote to it while we looked */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if(!match || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) return 0;
+
+  if(r) {
+    content_type[SHM_TYPE_SIZE - 1] = '\0';
+    body[len] = '\0';
+    r->body = body;
+    r->content_type = arena_strdup(r->arena, content_type);
+  }
+
+  return 1;
+}
+
+/* Looks for the given path in the cache, and copies it in to r if it's there
+   and hasn't changed (or just says whether it's there, if r is NULL).
+   Returns 1 if it was found, and 0 if not */
+static int lookup(const char *path, request *r) {
+  unsigned int hash;
+  const struct stat *known = NULL;
+  struct stat st, dir_st, now;
+  char dir[PATH_MAX];
+  shm_slot *s;
+  int way;
+
+  if(!shm || strlen(path) >= SHM_PATH_SIZE) return 0;
+
+  /* before looking, so that the file cache has dropped anything that's
+     changed from here too (see shm_drop_file()) */
+  if(r) known = cached_stat(path);
+
+  hash = path_hash(path);
+  for(way = 0; way < SHM_CACHE_WAYS; way++) {
+    s = get_slot(hash % num_sets, way);
+    if(read_slot(s, hash, path, r, &st, &dir_st)) break;
+  }
+  if(way == SHM_CACHE_WAYS) return 0;
+
+  __atomic_store_n(&s->used, 1, __ATOMIC_RELAXED);
+
+  if(r) {
+    /* make sure it hasn't changed, and hasn't got any compressed copies; the
+       file cache would have noticed those */
+    if((!known || !same_file(known, &st)) &&
+       (stat(path, &now) == -1 || !same_file(&now, &st) ||
+        dir_name(path, dir) == -1 || stat(dir, &now) == -1 ||
+        !same_file(&now, &dir_st))) {
+      drop_slot(s);
+      r->body = NULL;
+      return 0;
+    }
+
+    r->is_dir = 0;
+    r->statbuf = st;
+    r->content_length = st.st_size;
+    r->last_modified_t = st.st_mtime;
+    r->last_modified = arena_alloc(r->arena, HTTP_DATE_SIZE);
+    http_date(st.st_mtime, r->last_modified);
+  }
+
+  return 1;
+}
+
+/* Returns 1 if path is in the shared cache, or 0 if not; it may turn out to
+   have changed when it's used */
+int shm_file_cached(const char *path) {
+  return lookup(path, NULL);
+}
+
+/* Fills in the file stuff for the given request (see file_stuff()) from the
+   shared cache, with the file's contents in r->body.
+   Returns 1 on success, or 0 if r->file isn't in the cache */
+int use_shm_file(request *r) {
+  return lookup(r->file, r);
+}
+
+/* Drops path from the shared cache, if it's there */
+void shm_drop_file(const char *path) {
+  unsigned int hash;
+  struct stat st, dir_st;
+  shm_slot *s;
+  int way;
+
+  if(!shm || strlen(path) >= SHM_PATH_SIZE) return;
+
+  hash = path_hash(path);
+  for(way = 0; way < SHM_CACHE_WAYS; way++) {
+    s = get_slot(hash % num_sets, way);
+    if(read_slot(s, hash, path, NULL, &st, &dir_st)) drop_slot(s);
+  }
+}
+
+/* Returns the slot in the given set that a new file should go in */
+static shm_slot *victim(unsigned int set, unsigned int hash, const char *path) {
+  shm_slot *s;
+  unsigned int hand;
+  int way;
+
+  /* the same file, maybe out of date, or an empty slot */
+  for(way = 0; way < SHM_CACHE_WAYS; way++) {
+    s = get_slot(set, way);
+    if(s->hash == hash && strncmp(s->path, path, SHM_PATH_SIZE) == 0)
+      return s;
+  }
+  for(way = 0; way < SHM_CACHE_WAYS; way++) {
+    s = get_slot(set, way);
+    if(!s->hash) return s;
+  }
+
+  /* the first one that hasn't been used since the hand last went past it;
+     every slot's been passed after going round once */
+  for(way = 0; way < 2 * SHM_CACHE_WAYS; way++) {
+    hand = __atomic_fetch_add(&sets[set].hand, 1, __ATOMIC_RELAXED);
+    s = get_slot(set, hand % SHM_CACHE_WAYS);
+    if(!__atomic_exchange_n(&s->used, 0, __ATOMIC_RELAXED)) return s;
+  }
+
+  return s;
+}
+
+/* Adds the file that file_stuff() has just dealt with for the given request
+   to the shared cache, if it's a small enough regular file that it opened,
+   and puts its contents in r->body. A file with compressed copies isn't
+   added, so a file that's in the cache hasn't got any */
+void shm_cache_file(request *r) {
+  struct stat dir_st;
+  char dir[PATH_MAX];
+  unsigned int hash;
+  shm_slot *s;
+  char *body;
+  size_t len = r->content_length;
+  int i;
+
+  if(!shm || !S_ISREG(r->statbuf.st_mode) || len > shm_file_size ||
+     r->fildes == -1 || !r->stat_file || strcmp(r->stat_file, r->file) != 0 ||
+     r->content_type[0] == '/' || strlen(r->file) >= SHM_PATH_SIZE ||
+     strlen(r->content_type) >= SHM_TYPE_SIZE || !r->copies.known)
+    return;
+  for(i = 0; i < ENCODINGS; i++)
+    if(r->copies.fildes[i] != -1) return;
+  if(dir_name(r->file, dir) == -1 || stat(dir, &dir_st) == -1) return;
+
+  /* it's no use if it's changed size since it was stat()ed */
+  body = arena_alloc(r->arena, len + 1);
+  if(pread(r->fildes, body, len + 1, 0) != len) return;
+  body[len] = '\0';
+  r->body = body;
+
+  hash = path_hash(r->file);
+  s = victim(hash % num_sets, hash, r->file);
+  if(lock_slot(s) == -1) return;
+
+  s->hash = hash;
+  s->used = 1;
+  s->statbuf = r->statbuf;
+  s->dir_statbuf = dir_st;
+  strcpy(s->path, r->file);
+  strcpy(s->content_type, r->content_type);
+  s->len = len;
+  memcpy(s->data, body, len);
+
+  unlock_slot(s);
+}
@@ -0,0 +1,123 @@
+/* Timer wheel for serve
+
+   An event loop has a timeout for every one of its connections, which gets
+   moved every time the connection makes progress, so setting and cancelling
+   timers has to be cheap however many of them there are. The timers are kept
+   in a hierarchical wheel: the first level has a slot for each of the next
+   WHEEL_SLOTS seconds, the next has a slot for each of the WHEEL_SLOTS periods
+   of WHEEL_SLOTS seconds after that, and so on. Setting or cancelling a timer
+   just links it in to or out of a slot, and each time the first level goes
+   round, the next slot of the level above is spread out over it.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* the furthest ahead that a timer can be set for */
+#define WHEEL_SPAN (((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* each slot is a circular list with a dummy timer at its head */
+static timer wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static time_t current;/* the last second that has been dealt with */
+static int started;
+
+/* Returns the slot at the given level that time t belongs in */
+static timer *slot(int level, time_t t) {
+  return &wheel[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+}
+
+static void start(time_t now) {
+  int i, j;
+
+  for(i = 0; i < WHEEL_LEVELS; i++)
+    for(j = 0; j < WHEEL_SLOTS; j++)
+      wheel[i][j].prev = wheel[i][j].next = &wheel[i][j];
+
+  current = now;
+  started = 1;
+}
+
+/* Puts t in the slot for its expiry time */
+static void place(timer *t) {
+  timer *head;
+  time_t delta;
+  int level;
+
+  /* a timer in the past goes off at the next tick */
+  if(t->when <= current) t->when = current + 1;
+  if(t->when - current > WHEEL_SPAN) t->when = current + WHEEL_SPAN;
+
+  delta = t->when - current;
+  for(level = 0; level < WHEEL_LEVELS - 1; level++)
+    if(delta < (time_t)1 << (WHEEL_BITS * (level + 1))) break;
+
+  head = slot(level, t->when);
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+/* Sets t to go off at time when, instead of whenever it was set for before */
+void timer_set(timer *t, time_t when) {
+  if(!started) start(time(NULL));
+
+  timer_cancel(t);
+  t->when = when;
+  place(t);
+}
+
+/* Stops t from going off, if it was set */
+void timer_cancel(timer *t) {
+  if(!t->next) return;
+
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+/* Moves all of the timers in the given slot down to the levels below */
+static void cascade(int level, time_t t) {
+  timer *head = slot(level, t);
+  timer *list = head->next;
+  timer *next;
+
+  head->prev->next = NULL;
+  head->prev = head->next = head;
+
+  for(; list != head && list; list = next) {
+    next = list->next;
+    place(list);
+  }
+}
+
+/* Sets off every timer that was due to go off up to and including time now */
+void run_timers(time_t now) {
+  timer *head, *t;
+  int level;
+
+  if(!started) start(now);
+
+  while(current < now) {
+    current++;
+
+    /* each time a level goes round, bring down the next slot above it */
+    for(level = 1; level < WHEEL_LEVELS; level++)
+      if(current & (((time_t)1 << (WHEEL_BITS * level)) - 1)) break;
+    while(--level > 0) cascade(level, current);
+
+    /* a timer might cancel or set others when it goes off, so take them off
+       one at a time */
+    head = slot(0, current);
+    while((t = head->next) != head) {
+      timer_cancel(t);
+      t->fire(t);
+    }
+  }
+}
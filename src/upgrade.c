@@ -0,0 +1,188 @@
+/* Binary upgrades for serve
+
+   On SIGUSR2, the main process runs a new copy of serve (from the same path,
+   so it may be a new binary) and gives it the listening sockets through the
+   environment. Once the new server says that it's ready, the old one stops
+   accepting connections, sends SIGWINCH to the rest of its process group so
+   that they finish what they're doing and exit, and then exits itself.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#include <poll.h>
+
+volatile sig_atomic_t upgrading;/* SIGUSR2 has been received */
+volatile sig_atomic_t draining;/* SIGWINCH has been received */
+volatile sig_atomic_t idle;/* nothing would be lost if we exited now */
+
+static char **saved_argv;
+static int upgrade_fd = -1;/* tells the old server that we're ready */
+
+/* signal handler for SIGUSR2 */
+void request_upgrade(int sig) {
+  upgrading = 1;
+}
+
+/* signal handler for SIGWINCH */
+void request_drain(int sig) {
+  draining = 1;
+
+  /* a handler waiting for a request might wait a long time */
+  if(is_handler && idle) {
+    fclose(out);
+    fclose(err);
+    exit(0);
+  }
+}
+
+/* Remembers how we were run, so that we can be run the same way again */
+void init_upgrade(char **argv) {
+  saved_argv = argv;
+}
+
+/* Returns the listening sockets passed on by an old server that is upgrading
+   to us, and puts the number of them in num, or returns NULL if there aren't
+   any */
+int *inherited_sockets(int *num) {
+  char *fds, *ptr;
+  int *servfd;
+
+  if((ptr = getenv("SERVE_UPGRADE_FD"))) upgrade_fd = atoi(ptr);
+
+  if(!(fds = getenv("SERVE_LISTEN_FDS"))) return NULL;
+
+  servfd = malloc((strlen(fds) / 2 + 1) * sizeof(int));
+  *num = 0;
+  for(ptr = fds; *ptr; ptr++) {
+    servfd[*num] = strtol(ptr, &ptr, 10);
+    fcntl(servfd[(*num)++], F_SETFD, FD_CLOEXEC);
+    if(!*ptr) break;
+  }
+  if(upgrade_fd != -1) fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC);
+
+  /* don't pass them on to CGI scripts */
+  unsetenv("SERVE_LISTEN_FDS");
+  unsetenv("SERVE_UPGRADE_FD");
+
+  log_text(out, "Took over %d listening socket%s from the old server.", *num,
+           *num == 1 ? "" : "s");
+
+  return servfd;
+}
+
+/* Returns 1 if an old server is upgrading to us, and 0 otherwise */
+int taking_over(void) {
+  return upgrade_fd != -1;
+}
+
+/* Tells the old server that we're ready to take over from it */
+void upgrade_ready(void) {
+  if(upgrade_fd == -1) return;
+
+  write(upgrade_fd, "", 1);
+  close(upgrade_fd);
+  upgrade_fd = -1;
+}
+
+/* Runs a new server that takes over the num listening sockets in servfd, which
+   may contain duplicates.
+   Returns 0 once the new server is ready, or -1 if it couldn't be started */
+int upgrade(int *servfd, int num) {
+  struct pollfd pfd;
+  char buf[64];
+  char *fds;
+  int fildes[2];
+  pid_t pid;
+  int i, j, n;
+  char c;
+
+  upgrading = 0;
+
+  log_text(out, "Starting a new server to take over from this one.");
+
+  if(pipe(fildes) == -1) {
+    log_text(err, "Unable to create pipe for upgrade: %s", strerror(errno));
+    return -1;
+  }
+
+  fflush(out);
+  fflush(err);
+
+  if((pid = fork()) == -1) {
+    log_text(err, "Unable to fork for upgrade: %s", strerror(errno));
+    close(fildes[0]);
+    close(fildes[1]);
+    return -1;
+  }
+
+  if(pid == 0) {
+    close(fildes[0]);
+
+    /* list each socket once, and let it survive the exec */
+    fds = malloc(num * (decimal_length(int) + 1) + 1);
+    for(i = 0, n = 0; i < num; i++) {
+      for(j = 0; j < i && servfd[j] != servfd[i]; j++);
+      if(j < i) continue;
+      n += sprintf(fds + n, "%s%d", n ? "," : "", servfd[i]);
+      fcntl(servfd[i], F_SETFD, 0);
+    }
+    setenv("SERVE_LISTEN_FDS", fds, 1);
+    sprintf(buf, "%d", fildes[1]);
+    setenv("SERVE_UPGRADE_FD", buf, 1);
+
+    /* we don't want to be stopped along with the old server */
+    setpgid(0, 0);
+
+    execvp(saved_argv[0], saved_argv);
+    log_text(err, "Unable to run %s for upgrade: %s", saved_argv[0],
+             strerror(errno));
+    exit(1);
+  }
+
+  close(fildes[1]);
+
+  /* wait for the new server to tell us that it's ready; it closes the pipe
+     without doing so if it fails */
+  pfd.fd = fildes[0];
+  pfd.events = POLLIN;
+  while((n = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000)) == -1 && errno == EINTR);
+
+  n = (n == 1 && read(fildes[0], &c, 1) == 1);
+  close(fildes[0]);
+
+  if(!n) {
+    log_text(err, "New server didn't start, carrying on with this one.");
+    kill(pid, SIGTERM);
+    return -1;
+  }
+
+  log_text(out, "New server has taken over, finishing existing connections.");
+
+  return 0;
+}
+
+/* Stops accepting connections on the num sockets in servfd, waits for every
+   process handling a connection to finish, and then exits. The pidfile
+   belongs to the new server now, so it is left alone */
+void retire(int *servfd, int num) {
+  int i;
+
+  for(i = 0; i < num; i++) close(servfd[i]);
+
+  /* we want to wait for our children ourselves; the new server is one of
+     them, but it's in a process group of its own */
+  signal(SIGCHLD, SIG_DFL);
+
+  killpg(0, SIGWINCH);
+  while(waitpid(0, NULL, 0) != -1 || errno == EINTR);
+
+  log_text(out, "All connections finished, exiting.");
+
+  fclose(out);
+  fclose(err);
+
+  exit(0);
+}
@@ -0,0 +1,514 @@
+/* io_uring connection handling for serve
+
+   This drives the same connection state machine as the epoll engine (see
+   event.c), but instead of waiting to be told that a socket is ready and then
+   making the system call ourselves, the accepts, receives, sends, file reads,
+   statx() and openat() calls are all queued on an io_uring and submitted
+   together, once per trip around the loop.
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+#if defined(__linux__) && defined(USE_URING)
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+
+/* number of submission queue entries */
+#define RING_ENTRIES 256
+
+/* what each operation is for; this is kept in the bottom 3 bits of the
+   user_data, with the connection or job it belongs to in the rest */
+#define OP_ACCEPT  0
+#define OP_RECV    1 /* connection input */
+#define OP_WRITE   2 /* connection output, queued data or file data */
+#define OP_READ    3 /* reading file data to send */
+#define OP_STATX   4
+#define OP_OPEN    5
+#define OP_TIMEOUT 6
+#define OP_EVENTS  7 /* the filesystem pool's eventfd */
+
+#define OP_MASK 7
+
+/* an FS_OPEN job waiting for its statx() */
+typedef struct statx_job_s {
+  fsjob *job;
+  struct statx stx;
+} statx_job;
+
+static int ring_fd = -1;
+static unsigned sq_entries;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sqe_tail;/* the tail including entries we haven't submitted */
+
+static int listenfd = -1;
+static int fsfd = -1;
+static struct sockaddr_storage clientaddr;
+static socklen_t clientaddr_len;
+static uint64_t fs_count;
+static struct __kernel_timespec tick_time = { 1, 0 };
+
+/* operations that the engine can't do without */
+static int needed_ops[] = {
+  IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITEV,
+  IORING_OP_READ, IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_TIMEOUT
+};
+
+/* Returns 1 if the kernel can do all of the operations we need, 0 if not */
+static int supported(void) {
+  struct io_uring_probe *probe;
+  size_t i;
+  int ok = 1;
+
+  probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+
+  if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+             256) == -1) {
+    free(probe);
+    return 0;
+  }
+
+  for(i = 0; i < sizeof(needed_ops) / sizeof(int); i++) {
+    if(needed_ops[i] > probe->last_op ||
+       !(probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED))
+      ok = 0;
+  }
+
+  free(probe);
+
+  if(!ok) errno = ENOSYS;
+  return ok;
+}
+
+/* Sets up the ring; returns 0 on success and -1 on error */
+static int ring_init(void) {
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+
+  memset(&p, '\0', sizeof(p));
+  if((ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) == -1)
+    return -1;
+
+  if(!supported()) goto fail;
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  /* newer kernels have both rings in one mapping */
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = MAX(sq_size, cq_size);
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring_fd, IORING_OFF_SQ_RING);
+  if(sq == MAP_FAILED) goto fail;
+
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if(cq == MAP_FAILED) goto fail;
+  }
+
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+              IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) goto fail;
+
+  sq_entries = p.sq_entries;
+  sq_head = (unsigned*)(sq + p.sq_off.head);
+  sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + p.sq_off.array);
+  cq_head = (unsigned*)(cq + p.cq_off.head);
+  cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  sqe_tail = *sq_tail;
+
+  return 0;
+
+ fail:
+  close(ring_fd);
+  ring_fd = -1;
+  return -1;
+}
+
+/* Submits everything that has been queued, and waits for at least wait
+   operations to finish */
+static void enter(unsigned wait) {
+  unsigned n = sqe_tail - *sq_tail;
+
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+  while(syscall(__NR_io_uring_enter, ring_fd, n, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1) {
+    if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      log_text(err, "io_uring_enter failed: %s", strerror(errno));
+      exit(1);
+    }
+
+    /* everything was submitted even if we were interrupted while waiting */
+    n = 0;
+  }
+}
+
+/* Returns a cleared submission queue entry for an operation of the given type
+   on behalf of ptr */
+static struct io_uring_sqe *get_sqe(int op, void *ptr) {
+  struct io_uring_sqe *sqe;
+  unsigned i;
+
+  /* make room if the queue is full */
+  if(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+    enter(0);
+
+  i = sqe_tail++ & *sq_mask;
+  sqe = &sqes[i];
+  sq_array[i] = i;
+
+  memset(sqe, '\0', sizeof(*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+
+  return sqe;
+}
+
+/* Queues an operation on the connection's socket, and returns its entry */
+static struct io_uring_sqe *conn_op(connection *c, int op, int opcode,
+                                    void *buf, size_t len) {
+  struct io_uring_sqe *sqe = get_sqe(op, c);
+
+  sqe->opcode = opcode;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+
+  c->ops++;
+
+  return sqe;
+}
+
+/* Waits for the next connection */
+static void accept_next(void) {
+  struct io_uring_sqe *sqe = get_sqe(OP_ACCEPT, NULL);
+
+  clientaddr_len = sizeof(clientaddr);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->addr = (uintptr_t)&clientaddr;
+  sqe->addr2 = (uintptr_t)&clientaddr_len;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* Waits for the filesystem pool to finish some jobs */
+static void read_events(void) {
+  struct io_uring_sqe *sqe = get_sqe(OP_EVENTS, NULL);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fsfd;
+  sqe->addr = (uintptr_t)&fs_count;
+  sqe->len = sizeof(fs_count);
+}
+
+/* Wakes us up in a second, to check for timeouts */
+static void tick(void) {
+  struct io_uring_sqe *sqe = get_sqe(OP_TIMEOUT, NULL);
+
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&tick_time;
+  sqe->len = 1;
+}
+
+/* Looks the file up for an FS_OPEN job; finish_job() is called when it's
+   done */
+void uring_open(fsjob *job) {
+  statx_job *s = calloc(1, sizeof(statx_job));
+  struct io_uring_sqe *sqe = get_sqe(OP_STATX, s);
+
+  s->job = job;
+
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uintptr_t)&s->stx;
+}
+
+/* Fills in the job's stat() results from a statx() */
+static void statx_to_stat(struct statx *stx, struct stat *st) {
+  memset(st, '\0', sizeof(*st));
+
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Deals with a finished statx(), opening the file if it's a regular one */
+static void statx_done(statx_job *s, int res) {
+  fsjob *job = s->job;
+  struct io_uring_sqe *sqe;
+
+  if((job->result = res < 0 ? -1 : 0) == 0)
+    statx_to_stat(&s->stx, &job->statbuf);
+  free(s);
+
+  if(job->result == -1 || !S_ISREG(job->statbuf.st_mode)) {
+    finish_job(job);
+    return;
+  }
+
+  sqe = get_sqe(OP_OPEN, job);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+/* Starts sending the next part of the response, unless some is already being
+   sent. Once it has all gone, the connection gets ready for the next request.
+   Returns 0 on success, or -1 if the connection should be closed */
+int uring_send(connection *c) {
+  struct io_uring_sqe *sqe;
+  chunk *k;
+  int i;
+
+  if(c->writing) return 0;
+
+  if(!(k = c->out.head)) return output_sent(c);
+
+  if(c->state == CONN_RESPONSE || c->state == CONN_WAITING)
+    set_deadline(c, SEND_TIMEOUT);
+  c->writing = 1;
+
+  if(k->fildes == -1) {
+    /* send as many chunks of data as we can in one go */
+    for(i = 0; k && k->fildes == -1 && i < 16; k = k->next, i++) {
+      c->iov[i].iov_base = k->data + k->pos;
+      c->iov[i].iov_len = k->len - k->pos;
+    }
+    conn_op(c, OP_WRITE, IORING_OP_WRITEV, c->iov, i);
+  } else if(c->file_pos < c->file_len) {
+    /* send the file data we've already read */
+    conn_op(c, OP_WRITE, IORING_OP_SEND, c->filebuf + c->file_pos,
+            c->file_len - c->file_pos);
+  } else {
+    /* read some more of the file */
+    if(!c->filebuf) c->filebuf = malloc(CHUNK_SIZE);
+    sqe = conn_op(c, OP_READ, IORING_OP_READ, c->filebuf,
+                  MIN(k->len - k->pos, CHUNK_SIZE));
+    sqe->fd = k->fildes;
+    sqe->off = k->offset;
+  }
+
+  return 0;
+}
+
+/* Deals with any new input, and waits for more if we want it */
+static void progress(connection *c) {
+  if(process_input(c) == -1) {
+    close_connection(c);
+    return;
+  }
+
+  if(c->reading) return;
+  if(c->state != CONN_REQUEST && c->state != CONN_HEADERS) return;
+
+  if(grow_input(c) == -1) {
+    close_connection(c);
+    return;
+  }
+
+  conn_op(c, OP_RECV, IORING_OP_RECV, c->in + c->in_len,
+          c->in_size - c->in_len);
+  c->reading = 1;
+}
+
+/* Deals with a finished operation on a connection */
+static void conn_done(connection *c, int op, int res) {
+  c->ops--;
+
+  if(op == OP_RECV) c->reading = 0;
+  else c->writing = 0;
+
+  /* the connection was closed while the operation was running */
+  if(c->closing) {
+    if(!c->ops) close_connection(c);
+    return;
+  }
+
+  if(res == -EINTR || res == -EAGAIN) {
+    res = 0;
+  } else if(res <= 0) {/* EOF, error, or the file was truncated */
+    close_connection(c);
+    return;
+  }
+
+  switch(op) {
+  case OP_RECV:
+    got_input(c, res);
+    progress(c);
+    return;
+
+  case OP_READ:
+    c->file_len = res;
+    c->file_pos = 0;
+    break;
+
+  case OP_WRITE:
+    if(c->file_len) {
+      c->file_pos += res;
+      c->out.head->offset += res;
+      if(c->file_pos == c->file_len) c->file_len = c->file_pos = 0;
+    }
+    consume_queue(&c->out, res);
+    break;
+  }
+
+  if(uring_send(c) == -1) close_connection(c);
+  else progress(c);
+}
+
+/* Deals with a finished operation */
+static void complete(uint64_t user_data, int res) {
+  void *ptr = (void*)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+  int op = user_data & OP_MASK;
+  char addr[INET6_ADDRSTRLEN];
+  fsjob *job;
+
+  switch(op) {
+  case OP_ACCEPT:
+    if(!draining) accept_next();
+    if(res < 0) {
+      if(res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+        log_text(err, "accept failed: %s", strerror(-res));
+      return;
+    }
+    count_connection(res);
+    client_address(&clientaddr, addr);
+    progress(new_connection(res, addr));
+    return;
+
+  case OP_STATX:
+    statx_done(ptr, res);
+    return;
+
+  case OP_OPEN:
+    job = ptr;
+    job->fildes = res < 0 ? -1 : res;
+
+    /* the filesystem pool looks for compressed copies of it */
+    if(job->fildes != -1 && fsfd != -1) {
+      job->type = FS_COPIES;
+      fs_submit(job);
+      return;
+    }
+
+    finish_job(job);
+    return;
+
+  case OP_TIMEOUT:
+    tick();
+    run_timers(time(NULL));
+    return;
+
+  case OP_EVENTS:
+    read_events();
+    finish_jobs();
+    return;
+
+  default:
+    conn_done(ptr, op, res);
+  }
+}
+
+/* Forgets about the ring, in a handler process */
+void uring_close(void) {
+  close(ring_fd);
+}
+
+/* Runs the io_uring loop for connections accepted from servfd forever, or
+   the epoll loop if io_uring can't be used */
+void uring_loop(int servfd) {
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  uint64_t user_data;
+  int res;
+
+  if(ring_init() == -1) {
+    log_text(err, "Unable to use io_uring (%s), using epoll instead.",
+             strerror(errno));
+    engine = ENGINE_EPOLL;
+    event_loop(servfd);
+    return;
+  }
+
+  listenfd = servfd;
+
+  if((fsfd = init_events(servfd)) != -1) read_events();
+  accept_next();
+  tick();
+
+  while(1) {
+    enter(1);
+
+    head = *cq_head;
+    while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &cqes[head & *cq_mask];
+      user_data = cqe->user_data;
+      res = cqe->res;
+
+      /* give the entry back before dealing with it, as that can queue more */
+      __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+      complete(user_data, res);
+    }
+
+    if(stats_wanted) log_stats();
+    if(draining) drain_connections();
+  }
+}
+
+#else
+
+int uring_send(connection *c) {
+  return -1;
+}
+
+void uring_open(struct fsjob_s *job) {
+}
+
+void uring_close(void) {
+}
+
+void uring_loop(int servfd) {
+  log_text(err, "serve was built without io_uring support, using epoll "
+           "instead.");
+  engine = ENGINE_EPOLL;
+  event_loop(servfd);
+}
+
+#endif
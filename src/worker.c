@@ -0,0 +1,173 @@
+/* Pre-forked worker processes for serve
+
+   By James Stanley
+
+   Public domain */
+
+#include "serve.h"
+
+/* Thanks Beej :) */
+void *get_in_addr(struct sockaddr *sa) {
+  if(sa->sa_family == AF_INET) {
+    return &(((struct sockaddr_in*)sa)->sin_addr);
+  }
+
+  return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+/* Puts the textual address of the client at clientaddr in addr, which must be
+   at least INET6_ADDRSTRLEN bytes long */
+void client_address(struct sockaddr_storage *clientaddr, char *addr) {
+  inet_ntop(clientaddr->ss_family, get_in_addr((struct sockaddr*)clientaddr),
+            addr, INET6_ADDRSTRLEN);
+
+  /* HACK: get nice-looking IPv4 addresses even if we're on IPv6 */
+  if(strncmp(addr, "::ffff:", 7) == 0)
+    memmove(addr, addr + 7, strlen(addr + 7) + 1);
+}
+
+/* Accepts a connection from servfd and puts the textual address of the client
+   in addr, which must be at least INET6_ADDRSTRLEN bytes long. The new socket
+   is close-on-exec, and non-blocking if nonblocking is set.
+   Returns the new file descriptor, or -1 on error */
+int accept_client(int servfd, char *addr, int nonblocking) {
+  struct sockaddr_storage clientaddr;
+  socklen_t size = sizeof(struct sockaddr_storage);
+  int fd;
+
+#ifdef SOCK_CLOEXEC
+  fd = accept4(servfd, (struct sockaddr*)&clientaddr, &size,
+               SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+#else
+  fd = accept(servfd, (struct sockaddr*)&clientaddr, &size);
+  if(fd != -1) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if(nonblocking) set_nonblocking(fd, 1);
+  }
+#endif
+
+  if(fd == -1) {
+    if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+      log_text(err, "accept returned -1 and it wasn't EINTR.");
+    return -1;
+  }
+
+  count_connection(fd);
+
+  /* now get the textual IP address */
+  client_address(&clientaddr, addr);
+
+  return fd;
+}
+
+/* Accepts and handles connections forever, reusing this process for each
+   one */
+void worker_loop(int servfd) {
+  char addr[INET6_ADDRSTRLEN];
+  int fd;
+
+  while(!draining) {
+    if(stats_wanted) log_stats();
+
+    idle = 1;
+    fd = accept_client(servfd, addr, 0);
+    idle = 0;
+
+    if(fd != -1) handle(fd, addr);
+  }
+}
+
+/* Forks worker number i, which accepts connections from servfd[i], and returns
+   its pid, or -1 on error. servfd is the list of all num workers' listening
+   sockets, which may all be the same socket */
+pid_t spawn_worker(int *servfd, int num, int i) {
+  struct sigaction sa;
+  pid_t pid;
+  int j;
+
+  /* flush output streams so they don't get flushed once for the parent and
+     once for the child... */
+  fflush(out);
+  fflush(err);
+
+  if((pid = fork()) != 0) return pid;
+
+  /* child is a handler process */
+  is_handler = 1;
+
+  /* we only want our own listening socket */
+  for(j = 0; j < num; j++)
+    if(servfd[j] != servfd[i]) close(servfd[j]);
+
+  place_worker(i, servfd[i]);
+
+  /* a disconnected client shouldn't cost us the whole worker */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* workers still need to clean up after CGI scripts */
+  memset(&sa, '\0', sizeof(sa));
+  sa.sa_handler = ghost_buster;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  if(engine == ENGINE_URING) uring_loop(servfd[i]);
+  else if(engine == ENGINE_EPOLL) event_loop(servfd[i]);
+  else worker_loop(servfd[i]);
+  exit(0);
+}
+
+/* Starts num worker processes, each of which accepts connections from its own
+   entry in servfd, and then waits for them forever, respawning any that exit */
+void run_workers(int *servfd, int num) {
+  pid_t *pid;
+  time_t *started;
+  pid_t dead;
+  int status;
+  int i;
+
+  pid = calloc(num, sizeof(pid_t));
+  started = calloc(num, sizeof(time_t));
+
+  /* we want to reap the workers ourselves so that we know which one died */
+  signal(SIGCHLD, SIG_DFL);
+
+  for(i = 0; i < num; i++) {
+    if((pid[i] = spawn_worker(servfd, num, i)) == -1)
+      log_text(err, "Unable to fork worker process %d: %s", i,
+               strerror(errno));
+    started[i] = time(NULL);
+  }
+
+  log_text(out, "Started %d worker processes.", num);
+
+  while(1) {
+    if((dead = waitpid(-1, &status, 0)) == -1) {
+      /* each worker keeps its own stats */
+      if(stats_wanted) {
+        stats_wanted = 0;
+        for(i = 0; i < num; i++)
+          if(pid[i] != -1) kill(pid[i], SIGUSR1);
+      }
+      if(upgrading && upgrade(servfd, num) == 0) retire(servfd, num);
+      if(errno != EINTR) sleep(1);/* e.g. every worker failed to fork */
+    }
+
+    for(i = 0; i < num; i++) {
+      if(pid[i] != dead && pid[i] != -1) continue;
+
+      if(pid[i] == dead) {
+        if(WIFSIGNALED(status))
+          log_text(err, "Worker process %d was killed by signal %d, "
+                   "respawning.", dead, WTERMSIG(status));
+        else
+          log_text(err, "Worker process %d exited with status %d, "
+                   "respawning.", dead, WEXITSTATUS(status));
+      }
+
+      /* don't spin if workers are dying as soon as they start */
+      if(time(NULL) - started[i] < 1) sleep(1);
+
+      pid[i] = spawn_worker(servfd, num, i);
+      started[i] = time(NULL);
+    }
+  }
+}
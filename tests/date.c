@@ -0,0 +1,114 @@
+/* Round-trip test of serve's HTTP dates
+
+   Formats lots of random times with http_date(), checking that it writes the
+   same as the strftime() format that Last-Modified used to be made with, and
+   then in the other two formats that HTTP allows, and checks that get_date()
+   reads every one of them back as the same time. A few dates from RFC 7231
+   and some that aren't dates at all are checked too.
+
+   Usage: tests/date [TIMES]
+
+   By James Stanley
+
+   Public domain */
+
+#include "../src/serve.h"
+
+/* 31 Dec 9999 23:59:59, the last time that has a four digit year */
+#define LAST_TIME 253402300799LL
+
+/* 1 Jan 2069, when two digit years start meaning 1969 again */
+#define LAST_RFC850_TIME 3124224000LL
+
+/* a date and what get_date() should make of it */
+typedef struct example_s {
+  const char *date;
+  time_t t;
+} example;
+
+static const example examples[] = {
+  {"Sun, 06 Nov 1994 08:49:37 GMT", 784111777},
+  {"Sunday, 06-Nov-94 08:49:37 GMT", 784111777},
+  {"Sun Nov  6 08:49:37 1994", 784111777},
+  {"Thu, 01 Jan 1970 00:00:01 GMT", 1},
+  {"Tue, 29 Feb 2000 12:00:00 GMT", 951825600},
+  {"Monday, 31-Dec-68 23:59:59 GMT", 3124223999LL},
+  {"Wednesday, 31-Dec-69 23:59:59 GMT", -1},
+  {"Fri Dec 31 23:59:59 9999", LAST_TIME},
+  {"", 0},
+  {"Sun", 0},
+  {"garbage", 0},
+  {"Sun, 06 Nov 94 08:49:37 GMT", 0},
+  {"Sun, 32 Nov 1994 08:49:37 GMT", 0},
+  {"Sun, 06 Foo 1994 08:49:37 GMT", 0},
+  {"Sun, 06 Nov 1994 24:49:37 GMT", 0},
+  {"Sun, 06 Nov 1994 08:49 GMT", 0},
+  {"Sun Nov  6 08:49:37", 0}
+};
+
+#define EXAMPLES (sizeof(examples) / sizeof(examples[0]))
+
+/* Returns a random time from 0 up to last */
+static time_t random_time(long long last) {
+  long long t = ((long long)random() << 31) | random();
+
+  return t % (last + 1);
+}
+
+/* Checks that get_date() reads date back as t, printing what went wrong if it
+   doesn't.
+   Returns 0 if it does, or -1 if it doesn't */
+static int check(const char *date, time_t t) {
+  time_t got = get_date(date);
+
+  if(got == t) return 0;
+
+  printf("\"%s\" should be %lld, not %lld\n", date, (long long)t,
+         (long long)got);
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  long times = argc > 1 ? atol(argv[1]) : 1000000;
+  char ours[HTTP_DATE_SIZE], theirs[64];
+  int failed = 0;
+  struct tm tm;
+  time_t t;
+  long n;
+  int i;
+
+  for(i = 0; i < EXAMPLES; i++)
+    failed += check(examples[i].date, examples[i].t) == -1;
+
+  srandom(1);
+  for(n = 0; n < times && failed < 10; n++) {
+    t = random_time(n % 2 ? LAST_TIME : LAST_RFC850_TIME - 1);
+    gmtime_r(&t, &tm);
+
+    /* the format that we send */
+    http_date(t, ours);
+    strftime(theirs, sizeof(theirs), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if(strcmp(ours, theirs) != 0) {
+      printf("http_date(%lld) is \"%s\", not \"%s\"\n", (long long)t, ours,
+             theirs);
+      failed++;
+    }
+    failed += check(ours, t) == -1;
+
+    /* and the others, with two digit years in RFC 850 dates */
+    if(t < LAST_RFC850_TIME) {
+      strftime(theirs, sizeof(theirs), "%A, %d-%b-%y %H:%M:%S GMT", &tm);
+      failed += check(theirs, t) == -1;
+    }
+    strftime(theirs, sizeof(theirs), "%a %b %e %H:%M:%S %Y", &tm);
+    failed += check(theirs, t) == -1;
+  }
+
+  if(failed) {
+    printf("date: %d dates were wrong\n", failed);
+    return 1;
+  }
+
+  printf("date: %ld dates ok\n", EXAMPLES + times);
+  return 0;
+}
@@ -0,0 +1,220 @@
+/* Differential test of serve's request path decoding
+
+   Runs filename() and forbidden() on a list of awkward paths and on lots of
+   random ones made of slashes, dots, escapes good and bad, NULs, query
+   strings and control characters, and checks them against the old url_decode()
+   and filename(), which did a pass for each step, followed by a plain stack of
+   segments to take out the . and .. ones that the old code left in, and
+   against the old forbidden().
+
+   Usage: tests/decode [PATHS]
+
+   By James Stanley
+
+   Public domain */
+
+#include "../src/serve.h"
+
+#define MAX_PIECES 12
+
+/* what random paths are made of */
+static const char *pieces[] = {
+  "/", "//", ".", "..", "...", ".a", "a", "bc", "%2e", "%2E%2e", "%2f", "%2F",
+  "%00", "%41", "%", "%4", "%zz", "%g1", "~xyzzy", "?", "?x/../y", " ", "\t",
+  "\x01", "\xc3\xa9"
+};
+
+#define PIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+/* paths that have gone wrong before, or could */
+static const char *fixed[] = {
+  "", "/", "//", "/.", "/..", "/./.", "/a/./b", "/a/../b", "/a/b/..",
+  "/a/b/../", "/a/.", "/../x", "/a/../../x", "/../../a/..", "/../a/../b",
+  "//./../a", "/a//..//b", "/a/b/c/../../d", "/%2e%2e/etc/passwd",
+  "/a/%2e%2e/b", "/a/..%00b/c", "/a/.../b", "/a/..b/c", "/x/.git/../y",
+  "/.git/../i.html", "/.hidden", "/a/.hidden", "/a%2f..%2f..%2fb", "/a%",
+  "/a%4", "/a%4g", "/a?b/../c", "  /a/b", "/~xyzzy/../x", "/a/b%00/../c"
+};
+
+#define FIXED (sizeof(fixed) / sizeof(fixed[0]))
+
+/* The old url_decode(), which decoded buf where it was.
+   Returns buf, or NULL on error */
+static char *old_url_decode(char *buf) {
+  char *ptr = buf;
+  int i, c = 0, c2;
+  int state = 0;
+
+  for(i = 0; *ptr; ptr++) {
+    switch(state) {
+    case 0:
+      if(*ptr == '%') state = 1;
+      else buf[i++] = *ptr;
+      break;
+    case 1:
+      if((c = hex_to_digit(*ptr)) < 0) return NULL;
+      state = 2;
+      break;
+    case 2:
+      if((c2 = hex_to_digit(*ptr)) < 0) return NULL;
+      buf[i++] = (c << 4) | c2;
+      state = 0;
+      break;
+    }
+  }
+
+  buf[i] = '\0';
+
+  return buf;
+}
+
+/* The old filename(), without user directories, and with the dot segments
+   that it left in taken out afterwards.
+   Returns a path to free, or NULL if it can't be decoded */
+static char *old_filename(const char *buf) {
+  char *path, *ptr, *p, *s, *seg, *out;
+  const char *end;
+  int len, n;
+
+  if(*buf == '\0') return strdup(".");
+
+  while(iswhite(*buf)) buf++;
+  if((end = strchr(buf, '?'))) path = strdup2(buf, end - buf);
+  else path = strdup(buf);
+  if(!old_url_decode(path)) {
+    free(path);
+    return NULL;
+  }
+
+  /* leading slashes, then double slashes */
+  for(ptr = path; *ptr == '/'; ptr++);
+  for(p = ptr, s = ptr; *s; s++)
+    if(*s != '/' || s[1] != '/') *p++ = *s;
+  *p = '\0';
+  len = strlen(ptr);
+
+  /* trailing /., then trailing slashes */
+  if(len >= 2 && ptr[len - 1] == '.' && ptr[len - 2] == '/') len--;
+  while(len > 0 && ptr[len - 1] == '/') len--;
+  ptr[len] = '\0';
+
+  /* now take out the . and .. segments, keeping any .. that can't go back
+     over anything */
+  out = malloc(len + 2);
+  n = 0;
+  for(seg = strtok(ptr, "/"); seg; seg = strtok(NULL, "/")) {
+    if(strcmp(seg, ".") == 0) continue;
+    if(strcmp(seg, "..") == 0 && n && !(n == 2 && strncmp(out, "..", 2) == 0) &&
+       !(n > 2 && strcmp(out + n - 3, "/..") == 0)) {
+      while(n && out[n - 1] != '/') n--;
+      if(n) n--;
+      continue;
+    }
+    n += sprintf(out + n, "%s%s", n ? "/" : "", seg);
+  }
+  if(!n) out[n++] = '.';
+  out[n] = '\0';
+
+  free(path);
+  return out;
+}
+
+/* The old forbidden() */
+static int old_forbidden(const char *file) {
+  const char *ptr;
+  int level = 0;
+
+  if(!file) return 0;
+
+  if((*file == '.') && file[1] && file[1] != '/') return 1;
+  if((ptr = strrchr(file, '/')) && ptr[1] == '.') return 1;
+  if(strncmp(file, "../", 3) == 0) return 1;
+
+  for(ptr = file; (ptr = strchr(ptr + 1, '/'));) {
+    if(strncmp(ptr, "/../", 4) == 0) level--;
+    else if(strncmp(ptr, "/./", 3) != 0) level++;
+
+    if(level < 0) return 1;
+  }
+
+  return 0;
+}
+
+/* Prints a path with anything unprintable escaped */
+static void print_path(const char *what, const char *path) {
+  printf("  %s: ", what);
+  if(!path) {
+    printf("NULL\n");
+    return;
+  }
+  for(; *path; path++) {
+    if(*path < 0x20 || *path == 0x7f || (unsigned char)*path >= 0x80)
+      printf("\\x%02x", (unsigned char)*path);
+    else
+      putchar(*path);
+  }
+  putchar('\n');
+}
+
+/* Checks filename() and forbidden() on the given path against the old
+   functions.
+   Returns 0 if they agree, or -1 if they don't */
+static int check(arena *a, const char *path) {
+  char *want = old_filename(path);
+  char *got = filename(a, path);
+  int ok;
+
+  ok = (!want && !got) || (want && got && strcmp(want, got) == 0 &&
+                           forbidden(got) == old_forbidden(want));
+  if(!ok) {
+    printf("Mismatch for path\n");
+    print_path("path", path);
+    print_path("old", want);
+    print_path("new", got);
+    if(want && got)
+      printf("  forbidden: old %d, new %d\n", old_forbidden(want),
+             forbidden(got));
+  }
+
+  free(want);
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  long paths = argc > 1 ? atol(argv[1]) : 1000000;
+  char path[MAX_PIECES * 8 + 2];
+  arena *a = new_arena();
+  int failed = 0;
+  long n;
+  int i, pieces_in;
+
+  init_scan();
+  srandom(1);
+
+  for(i = 0; i < FIXED; i++)
+    failed += check(a, fixed[i]) == -1;
+
+  for(n = 0; n < paths && failed < 10; n++) {
+    strcpy(path, random() % 8 ? "/" : "");
+    pieces_in = random() % (MAX_PIECES + 1);
+    for(i = 0; i < pieces_in; i++) strcat(path, pieces[random() % PIECES]);
+
+    failed += check(a, path) == -1;
+
+    /* the paths all came from the arena, so start it again now and then */
+    if(n % 1000 == 999) {
+      free_arena(a);
+      a = new_arena();
+    }
+  }
+
+  free_arena(a);
+
+  if(failed) {
+    printf("decode: %d paths came out differently\n", failed);
+    return 1;
+  }
+
+  printf("decode: %ld paths ok\n", FIXED + paths);
+  return 0;
+}